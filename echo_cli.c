@@ -12,6 +12,8 @@
 
 int pipefd; // pipe file descriptor passed from client parent
 
+static struct linebuf lb; // receive buffer of the socket
+
 /* --------------------------------------------------------------------------
  *  main
  *
@@ -67,12 +69,16 @@ int main(int argc, char **argv) {
  *  @return : void
  *
  *  Handle all the process between echo client child process and the server
+ *  Lines are printed straight from the receive buffer, see linebuf.c
  * --------------------------------------------------------------------------
  */
 void cli_echo(FILE *fp, int sockfd) {
-    int     maxfdp1, stdineof;
-    fd_set  rset;
-    char    sendline[ECHO_BUFFSIZE], recvline[ECHO_BUFFSIZE];
+    int         maxfdp1, stdineof;
+    ssize_t     n;
+    fd_set      rset;
+    char        sendline[ECHO_BUFFSIZE];
+
+    lb_init(&lb, sockfd);
 
     FD_ZERO(&rset);
     // stdineof is used as flag that indicates the client finished all the requests
@@ -87,16 +93,18 @@ void cli_echo(FILE *fp, int sockfd) {
         Select(maxfdp1, &rset, NULL, NULL, NULL);
 
         if (FD_ISSET(sockfd, &rset)) {
-            // try to read from the socket
-            if (Readline(sockfd, recvline, ECHO_BUFFSIZE) == 0)
-                if (stdineof == 1)
-                    return;
-                else
+            // try to read from the socket, once, so that select() sees
+            // everything that is not in the buffer yet
+            if ((n = lb_fill(&lb)) < 0)
+                err_sys("cli_echo: read error");
+            // print every complete line in both parent and child window,
+            // at EOF the last line even without its newline
+            lb_flush(&lb, stdout, "< ", pipefd, n == 0);
+            if (n == 0) {
+                if (stdineof == 0)
                     err_quit("cli_echo: server terminated prematurely");
-            printf("< ");
-            // print in both parent and child window
-            Fputs(recvline, stdout);
-            Writen(pipefd, recvline, strlen(recvline)+1);
+                return;
+            }
         }
         if (FD_ISSET(fileno(fp), &rset)) {
             // try to read from stdin
@@ -3,8 +3,14 @@
 
 #include <sys/file.h>
 #include <termios.h>
+#include <stdint.h>
+#include <poll.h>
 #include "unpthread.h"
 
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
 // Port definition
 
 #define PORT_ECHO   61173
@@ -17,22 +23,179 @@
 #define PIPE_BUFFSIZE       1024
 #define ECHO_BUFFSIZE       1024
 #define TIME_BUFFSIZE       1024
+#define LINE_BUFFSIZE       65536
+
+// iovecs per writev() of the line buffer output, see lb_flush
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define LINE_IOVMAX         IOV_MAX
+#else
+#define LINE_IOVMAX         1024
+#endif
 
 // Keyboard nonblocking constants
 
 #define NB_ENABLE  0
 #define NB_DISABLE 1
 
+// receive buffer split into lines in place, see linebuf.c
+struct linebuf {
+    int     fd;
+    size_t  start;      // first byte not handed out yet
+    size_t  scan;       // bytes before it are known to hold no newline
+    size_t  end;        // end of the received data
+    char    buf[LINE_BUFFSIZE];
+};
+
+// Service type definition
+
+#define SERVICE_ECHO    1
+#define SERVICE_TIME    2
+
+// Hot restart (handoff) definition
+
+#define HANDOFF_PATH        "/tmp/echotime.handoff"
+#define HANDOFF_BATCH       64      // fds carried by one SCM_RIGHTS message
+#define HANDOFF_TIMEOUT     5       // seconds to wait for threads to park
+#define HANDOFF_REQWAIT     200     // milliseconds to wait for the request
+
+#define HANDOFF_LISTEN      'L'     // take over the listening sockets only
+#define HANDOFF_LIVE        'C'     // take over the live connections as well
+
+// connection record shared by the main thread and the service threads
+struct conn {
+    int             fd;
+    int             service;    // SERVICE_ECHO or SERVICE_TIME
+    int             parked;     // fd given up by its thread for handoff
+    uint64_t        accepted;   // trace timestamp of accept, 0 if not sampled
+    pthread_t       tid;        // serving thread, or event loop thread
+    struct conn     *prev, *next;
+
+    // event loop mode only
+    int             loop;       // event loop the connection is assigned to
+    int             moveto;     // event loop it is queued for, -1 once polled
+    unsigned long   bytes;      // bytes echoed so far
+    unsigned long   lastbytes;  // bytes at the last rebalancing round
+    double          rate;       // bytes per second, smoothed
+    struct linebuf  *lb;        // line buffer in line mode
+    struct conn     *lnext;     // event loop incoming queue
+    char            *out;       // output the client has not taken yet
+    size_t          outcap;     // size of out
+    size_t          outpos;     // out[outpos..outlen-1] is pending
+    size_t          outlen;
+    int             closing;    // EOF read, close once out is sent
+};
+
+// Event loop definition
+
+#define LOOP_MAX            64
+#define LOOP_INTERVAL       1       // seconds between rebalancing rounds
+#define LOOP_IMBALANCE      1.25    // busiest loop over average load to rebalance
+#define LOOP_MINRATE        65536   // bytes per second below which no loop is busy
+#define LOOP_HOTRATE        16384   // bytes per second below which no connection moves
+
+// event loop thread multiplexing ECHO connections with poll()
+struct evloop {
+    int             id;
+    pthread_t       tid;
+    int             wakefd[2];  // self-pipe to interrupt poll()
+    pthread_mutex_t mutex;      // protects incoming and moving
+    struct conn     *incoming;  // connections to adopt
+    int             moving;     // some connection has moveto set
+    int             n, cap;     // pv[0] is the self-pipe, cv[0] unused
+    struct pollfd   *pv;
+    struct conn     **cv;
+    double          load;       // bytes per second, by the balancer
+    int             nconn;      // connections, by the balancer and placement
+};
+
+// handoff message, the fds travel as SCM_RIGHTS ancillary data
+struct handoff_hdr {
+    int nfds;                       // number of fds attached
+    int more;                       // another message follows
+    int service[HANDOFF_BATCH];     // service type of each fd
+};
+
+
+// Tracing definition
+//   Each stage is a USDT probe echotime:<stage> when built with -DHAVE_SDT,
+//   a nop until a tracer attaches. The sampling mode (-t) also records the
+//   stages of the sampled threads, see trace.c
+
+#define TRACE_EVENTS    4096    // events kept per thread
+#define TRACE_PATH      "/tmp/echotime.trace.json"
+
+// stages, each one ends the time span named after it
+enum trace_stage {
+    TRACE_main_wake,            // main select() returned
+    TRACE_accept,               // Accept() returned
+    TRACE_thread_start,         // service thread running
+    TRACE_select_wake,          // service select() returned
+    TRACE_read,                 // read() returned
+    TRACE_write,                // Writen() returned
+    TRACE_NSTAGE
+};
+
+struct trace_event {
+    uint64_t    ns;
+    int         stage;
+    int         fd;
+};
+
+// per-thread event ring, reused by later threads once detached
+struct tracebuf {
+    int                 id;
+    int                 busy;   // attached to a running thread
+    unsigned long       next;   // events recorded so far
+    struct tracebuf     *link;
+    struct trace_event  ev[TRACE_EVENTS];
+};
+
+extern int                          trace_rate;
+extern __thread struct tracebuf     *trace_tb;
+extern volatile sig_atomic_t        trace_dump_req;
+
+#ifdef HAVE_SDT
+#define TRACE_PROBE(stage, fd)  DTRACE_PROBE1(echotime, stage, fd)
+#else
+#define TRACE_PROBE(stage, fd)
+#endif
+
+#define TRACE(stage, fd)                                \
+    do {                                                \
+        TRACE_PROBE(stage, fd);                         \
+        if (trace_tb != NULL)                           \
+            trace_record(TRACE_##stage, fd);            \
+    } while (0)
 
 // function headers
 
 static void *echoserv(void *arg);
 static void *timeserv(void *arg);
 
-void str_echo(int);
-void str_time(int);
+int str_echo(int);
+int str_time(int);
 
 void cli_echo(FILE*, int);
 void cli_time(int);
 
+const char *lb_findnl(const char *, size_t);
+void lb_init(struct linebuf *, int);
+ssize_t lb_fill(struct linebuf *);
+size_t lb_next(struct linebuf *, const char **);
+size_t lb_rest(struct linebuf *, const char **);
+int lb_flush(struct linebuf *, FILE *, const char *, int, int);
+
+uint64_t trace_now(void);
+void trace_attach(uint64_t, int);
+void trace_detach(void);
+void trace_record(int, int);
+void trace_dump(void);
+
+int handoff_listen(const char *);
+int handoff_connect(const char *);
+int handoff_peer(int);
+int handoff_send(int, struct handoff_hdr *, const int *);
+int handoff_recv(int, struct handoff_hdr *, int *);
+
 #endif
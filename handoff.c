@@ -0,0 +1,223 @@
+/*
+* @Author: Yinlong Su
+* @Date:   2026-10-19 10:12:37
+* @Last Modified by:   Yinlong Su
+* @Last Modified time: 2026-10-19 10:12:37
+*
+* File:         handoff.c
+* Description:  Hot restart descriptor passing C file
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE     // struct ucred
+#endif
+
+#include "echotime.h"
+
+#ifdef __sun
+#include <ucred.h>
+#endif
+
+/* --------------------------------------------------------------------------
+ *  handoff_listen
+ *
+ *  Create the handoff control socket
+ *
+ *  @param  : const char* path
+ *  @return : int (listening Unix domain socket file descriptor)
+ *
+ *  Bind a Unix domain stream socket to path and listen on it. A stale
+ *  path left by the previous instance is removed first.
+ * --------------------------------------------------------------------------
+ */
+int handoff_listen(const char *path) {
+    int                 fd;
+    struct sockaddr_un  addr;
+
+    fd = Socket(AF_LOCAL, SOCK_STREAM, 0);
+
+    unlink(path);
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    Bind(fd, (SA *)&addr, sizeof(addr));
+    Listen(fd, LISTENQ);
+    return fd;
+}
+
+/* --------------------------------------------------------------------------
+ *  handoff_connect
+ *
+ *  Connect to the handoff control socket of the running server
+ *
+ *  @param  : const char* path
+ *  @return : int (connected socket file descriptor, -1 on error)
+ * --------------------------------------------------------------------------
+ */
+int handoff_connect(const char *path) {
+    int                 fd;
+    struct sockaddr_un  addr;
+
+    fd = Socket(AF_LOCAL, SOCK_STREAM, 0);
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // use connect rather than Connect, no running server is not fatal here
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* --------------------------------------------------------------------------
+ *  handoff_peer
+ *
+ *  Check the peer of a handoff control connection
+ *
+ *  @param  : int sockfd
+ *  @return : int (0 if the peer runs as our effective user, -1 otherwise)
+ *
+ *  Anybody able to connect to HANDOFF_PATH could take the listening
+ *  sockets over, so only a process of the same user is served. The peer
+ *  credentials come from SO_PEERCRED (Linux), getpeerucred (Solaris) or
+ *  getpeereid (BSD).
+ * --------------------------------------------------------------------------
+ */
+int handoff_peer(int sockfd) {
+    uid_t       uid;
+#if defined(SO_PEERCRED)
+    struct ucred    cr;
+    socklen_t       len = sizeof(cr);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cr, &len) < 0)
+        return -1;
+    uid = cr.uid;
+#elif defined(__sun)
+    ucred_t     *uc = NULL;
+
+    if (getpeerucred(sockfd, &uc) < 0)
+        return -1;
+    uid = ucred_geteuid(uc);
+    ucred_free(uc);
+#else
+    gid_t       gid;
+
+    if (getpeereid(sockfd, &uid, &gid) < 0)
+        return -1;
+#endif
+
+    if (uid != geteuid()) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  handoff_send
+ *
+ *  Send a handoff message
+ *
+ *  @param  : int                   sockfd
+ *            struct handoff_hdr*   hdr
+ *            const int*            fds (hdr->nfds descriptors)
+ *  @return : int (0 on success, -1 on error)
+ *
+ *  The header goes as normal data and the descriptors as SCM_RIGHTS
+ *  ancillary data, so the kernel duplicates them into the receiver.
+ * --------------------------------------------------------------------------
+ */
+int handoff_send(int sockfd, struct handoff_hdr *hdr, const int *fds) {
+    struct msghdr   msg;
+    struct iovec    iov[1];
+    struct cmsghdr  *cmptr;
+    union {
+        struct cmsghdr  cm;
+        char            control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    } control_un;
+
+    if (hdr->nfds < 0 || hdr->nfds > HANDOFF_BATCH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bzero(&msg, sizeof(msg));
+    iov[0].iov_base = hdr;
+    iov[0].iov_len  = sizeof(*hdr);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 1;
+
+    if (hdr->nfds > 0) {
+        msg.msg_control     = control_un.control;
+        msg.msg_controllen  = CMSG_SPACE(sizeof(int) * hdr->nfds);
+
+        cmptr = CMSG_FIRSTHDR(&msg);
+        cmptr->cmsg_len     = CMSG_LEN(sizeof(int) * hdr->nfds);
+        cmptr->cmsg_level   = SOL_SOCKET;
+        cmptr->cmsg_type    = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmptr), fds, sizeof(int) * hdr->nfds);
+    }
+
+    if (sendmsg(sockfd, &msg, 0) != sizeof(*hdr))
+        return -1;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  handoff_recv
+ *
+ *  Receive a handoff message
+ *
+ *  @param  : int                   sockfd
+ *            struct handoff_hdr*   hdr
+ *            int*                  fds (room for HANDOFF_BATCH descriptors)
+ *  @return : int (number of descriptors received, -1 on error)
+ *
+ *  A message whose descriptor count does not match its header is
+ *  rejected, any descriptors it carried are closed.
+ * --------------------------------------------------------------------------
+ */
+int handoff_recv(int sockfd, struct handoff_hdr *hdr, int *fds) {
+    ssize_t         n;
+    int             i, nfds = 0;
+    struct msghdr   msg;
+    struct iovec    iov[1];
+    struct cmsghdr  *cmptr;
+    union {
+        struct cmsghdr  cm;
+        char            control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    } control_un;
+
+    bzero(&msg, sizeof(msg));
+    iov[0].iov_base     = hdr;
+    iov[0].iov_len      = sizeof(*hdr);
+    msg.msg_iov         = iov;
+    msg.msg_iovlen      = 1;
+    msg.msg_control     = control_un.control;
+    msg.msg_controllen  = sizeof(control_un.control);
+
+    if ((n = recvmsg(sockfd, &msg, MSG_WAITALL)) < 0)
+        return -1;
+
+    for (cmptr = CMSG_FIRSTHDR(&msg); cmptr != NULL; cmptr = CMSG_NXTHDR(&msg, cmptr)) {
+        if (cmptr->cmsg_level != SOL_SOCKET || cmptr->cmsg_type != SCM_RIGHTS)
+            continue;
+        i = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nfds + i > HANDOFF_BATCH)
+            i = HANDOFF_BATCH - nfds;
+        memcpy(fds + nfds, CMSG_DATA(cmptr), sizeof(int) * i);
+        nfds += i;
+    }
+
+    if (n != sizeof(*hdr) || (msg.msg_flags & MSG_CTRUNC) || hdr->nfds != nfds) {
+        for (i = 0; i < nfds; i++)
+            close(fds[i]);
+        errno = EPROTO;
+        return -1;
+    }
+    return nfds;
+}
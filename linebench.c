@@ -0,0 +1,144 @@
+/*
+* @Author: Yinlong Su
+* @Date:   2026-10-19 21:12:44
+* @Last Modified by:   Yinlong Su
+* @Last Modified time: 2026-10-19 21:12:44
+*
+* File:         linebench.c
+* Description:  Line splitter benchmark C file
+*/
+
+#include "echotime.h"
+
+#define BENCH_BYTES     (64 << 20)  // bytes handled per line length
+
+static struct linebuf   lb;
+static int              drainfd;    // read end of the benchmark pipe
+
+/* --------------------------------------------------------------------------
+ *  now
+ *
+ *  Benchmark clock function
+ *
+ *  @param  : void
+ *  @return : double (seconds)
+ * --------------------------------------------------------------------------
+ */
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* --------------------------------------------------------------------------
+ *  drain
+ *
+ *  Pipe reader thread function, the client parent of the benchmark
+ *
+ *  @param  : void* arg (unused)
+ *  @return : void*
+ * --------------------------------------------------------------------------
+ */
+static void *drain(void *arg) {
+    char buf[PIPE_BUFFSIZE];
+
+    while (read(drainfd, buf, sizeof(buf)) > 0)
+        ;
+    return (NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  per_line
+ *
+ *  Output path of the clients before linebuf.c
+ *
+ *  @param  : FILE* fp
+ *            int   pipefd
+ *  @return : void
+ *
+ *  Copy each line out of the buffer byte by byte as Readline does, then
+ *  print it with stdio and write it with its NUL to the pipe
+ * --------------------------------------------------------------------------
+ */
+static void per_line(FILE *fp, int pipefd) {
+    char        line[LINE_BUFFSIZE + 1], *q;
+    const char  *p = lb.buf, *end = lb.buf + lb.end;
+
+    while (p < end) {
+        q = line;
+        do {
+            *q = *p++;
+        } while (*q++ != '\n' && p < end);
+        *q = '\0';
+
+        Fputs("< ", fp);
+        Fputs(line, fp);
+        Writen(pipefd, line, q - line + 1);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  main
+ *
+ *  Entry function
+ *
+ *  @param  : int   argc
+ *            char  **argv
+ *  @return : int
+ *  @see    : per_line, lb_flush
+ *  @usage  : ./linebench [line length ...]
+ *
+ *  For each line length (8, 26, 80 and 1000 bytes by default), fill the
+ *  line buffer with lines and time BENCH_BYTES of output through both
+ *  paths. The terminal is /dev/null and the pipe is drained by a thread,
+ *  so the numbers include the syscalls but not the xterm or the parent.
+ * --------------------------------------------------------------------------
+ */
+int main(int argc, char **argv) {
+    static const int    deflen[] = { 8, 26, 80, 1000 };
+    int                 i, k, len, reps, nlen, pfd[2];
+    size_t              n;
+    double              t0, t1, t2;
+    FILE                *fp;
+    pthread_t           tid;
+
+    if ((fp = fopen("/dev/null", "w")) == NULL)
+        err_sys("linebench: cannot open /dev/null");
+    Pipe(pfd);
+    drainfd = pfd[0];
+    Pthread_create(&tid, NULL, &drain, NULL);
+
+    nlen = (argc > 1) ? argc - 1 : sizeof(deflen) / sizeof(deflen[0]);
+    printf("%8s %14s %14s %8s\n", "line", "per line MB/s", "lb_flush MB/s", "speedup");
+
+    for (k = 0; k < nlen; k++) {
+        len = (argc > 1) ? atoi(argv[k + 1]) : deflen[k];
+        if (len < 1 || len > LINE_BUFFSIZE)
+            err_quit("linebench: line length must be 1 to %d", LINE_BUFFSIZE);
+
+        n = LINE_BUFFSIZE / len * len;
+        for (i = 0; i < (int)n; i++)
+            lb.buf[i] = (i % len == len - 1) ? '\n' : 'a';
+        reps = BENCH_BYTES / n;
+
+        lb_init(&lb, -1);
+        lb.end = n;
+        t0 = now();
+        for (i = 0; i < reps; i++)
+            per_line(fp, pfd[1]);
+        fflush(fp);
+
+        t1 = now();
+        for (i = 0; i < reps; i++) {
+            lb.start = lb.scan = 0;
+            lb.end = n;
+            lb_flush(&lb, fp, "< ", pfd[1], 0);
+        }
+        t2 = now();
+
+        printf("%8d %14.1f %14.1f %7.1fx\n", len, n * reps / (t1 - t0) / 1e6,
+               n * reps / (t2 - t1) / 1e6, (t1 - t0) / (t2 - t1));
+    }
+    exit(0);
+}
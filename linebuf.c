@@ -0,0 +1,252 @@
+/*
+* @Author: Yinlong Su
+* @Date:   2026-10-19 14:03:52
+* @Last Modified by:   Yinlong Su
+* @Last Modified time: 2026-10-19 14:03:52
+*
+* File:         linebuf.c
+* Description:  Zero-copy line splitter C file
+*/
+
+#include "echotime.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* --------------------------------------------------------------------------
+ *  lb_findnl
+ *
+ *  Newline search function
+ *
+ *  @param  : const char*   p
+ *            size_t        n
+ *  @return : const char* (first '\n' in p[0..n-1], NULL if none)
+ *
+ *  Compare 32 (AVX2) or 16 (SSE2) bytes at a time against '\n' and turn
+ *  the result into a bit mask, so there is one branch per block instead
+ *  of one per byte. The instruction set is picked at compile time, build
+ *  with -mavx2 to get the AVX2 loop. The tail is scanned byte by byte.
+ * --------------------------------------------------------------------------
+ */
+const char *lb_findnl(const char *p, size_t n) {
+    const char *end = p + n;
+
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    unsigned int  m32;
+
+    for ( ; end - p >= 32; p += 32) {
+        m32 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl32));
+        if (m32 != 0)
+            return p + __builtin_ctz(m32);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    unsigned int  m16;
+
+    for ( ; end - p >= 16; p += 16) {
+        m16 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl16));
+        if (m16 != 0)
+            return p + __builtin_ctz(m16);
+    }
+#endif
+
+    for ( ; p < end; p++)
+        if (*p == '\n')
+            return p;
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  lb_init
+ *
+ *  Line buffer initialization function
+ *
+ *  @param  : struct linebuf*   lb
+ *            int               fd
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+void lb_init(struct linebuf *lb, int fd) {
+    lb->fd      = fd;
+    lb->start   = 0;
+    lb->scan    = 0;
+    lb->end     = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  lb_fill
+ *
+ *  Line buffer read function
+ *
+ *  @param  : struct linebuf* lb
+ *  @return : ssize_t (as read(), -1 with ENOBUFS if the buffer is full)
+ *
+ *  Move the unconsumed partial line to the front of the buffer, then
+ *  call read() once for as much as fits. Any line handed out before is
+ *  invalid afterwards.
+ * --------------------------------------------------------------------------
+ */
+ssize_t lb_fill(struct linebuf *lb) {
+    ssize_t n;
+
+    if (lb->start > 0) {
+        memmove(lb->buf, lb->buf + lb->start, lb->end - lb->start);
+        lb->scan -= lb->start;
+        lb->end  -= lb->start;
+        lb->start = 0;
+    }
+    if (lb->end == LINE_BUFFSIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if ((n = read(lb->fd, lb->buf + lb->end, LINE_BUFFSIZE - lb->end)) > 0)
+        lb->end += n;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  lb_next
+ *
+ *  Line buffer split function
+ *
+ *  @param  : struct linebuf*   lb
+ *            const char**      line
+ *  @return : size_t (length of the line including '\n', 0 if none)
+ *
+ *  Hand out the next complete line as a pointer into the buffer, no copy
+ *  is made and the line is not NUL terminated. A line that fills the
+ *  whole buffer is handed out without its newline, like Readline does.
+ *  The bytes already known to be newline free are not scanned again.
+ * --------------------------------------------------------------------------
+ */
+size_t lb_next(struct linebuf *lb, const char **line) {
+    const char  *nl;
+    size_t      n;
+
+    nl = lb_findnl(lb->buf + lb->scan, lb->end - lb->scan);
+    if (nl == NULL) {
+        lb->scan = lb->end;
+        if (lb->start > 0 || lb->end < LINE_BUFFSIZE)
+            return 0;
+        nl = lb->buf + lb->end - 1;
+    }
+
+    *line = lb->buf + lb->start;
+    n = nl + 1 - *line;
+    lb->start += n;
+    lb->scan = lb->start;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  lb_rest
+ *
+ *  Line buffer flush function
+ *
+ *  @param  : struct linebuf*   lb
+ *            const char**      line
+ *  @return : size_t (length of the partial line, 0 if none)
+ *
+ *  Hand out whatever is left after the last newline, used at EOF
+ * --------------------------------------------------------------------------
+ */
+size_t lb_rest(struct linebuf *lb, const char **line) {
+    size_t n = lb->end - lb->start;
+
+    *line = lb->buf + lb->start;
+    lb->start = lb->scan = lb->end;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  lb_writevn
+ *
+ *  Gather write function
+ *
+ *  @param  : int           fd
+ *            struct iovec* iov
+ *            int           iovcnt
+ *  @return : void
+ *
+ *  writev() until every iovec is written, a short write may stop in the
+ *  middle of one. The iovecs are modified.
+ * --------------------------------------------------------------------------
+ */
+static void lb_writevn(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err_sys("lb_writevn: writev error");
+        }
+        for ( ; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+            n -= iov->iov_len;
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  lb_flush
+ *
+ *  Line buffer output function
+ *
+ *  @param  : struct linebuf*   lb
+ *            FILE*             fp (terminal output)
+ *            const char*       prefix (printed before each line on fp)
+ *            int               pipefd
+ *            int               eof (hand out the partial line as well)
+ *  @return : int (number of lines)
+ *
+ *  Print every complete line on fp and send it to the client parent as a
+ *  pipe message, i.e. followed by a NUL. Up to LINE_IOVMAX / 2 lines go
+ *  out with one writev() to each of them, straight from the buffer.
+ * --------------------------------------------------------------------------
+ */
+int lb_flush(struct linebuf *lb, FILE *fp, const char *prefix, int pipefd, int eof) {
+    struct iovec    out[LINE_IOVMAX], msg[LINE_IOVMAX];
+    int             nout = 0, nmsg = 0, lines = 0;
+    size_t          n;
+    const char      *line;
+
+    // whatever fp has buffered goes first
+    fflush(fp);
+
+    for ( ; ; ) {
+        if ((n = lb_next(lb, &line)) == 0 && eof)
+            n = lb_rest(lb, &line);
+
+        if (n > 0) {
+            if (*prefix != '\0') {
+                out[nout].iov_base  = (void *)prefix;
+                out[nout++].iov_len = strlen(prefix);
+            }
+            out[nout].iov_base  = (void *)line;
+            out[nout++].iov_len = n;
+            msg[nmsg].iov_base  = (void *)line;
+            msg[nmsg++].iov_len = n;
+            msg[nmsg].iov_base  = "";
+            msg[nmsg++].iov_len = 1;
+            lines++;
+        }
+
+        // out never holds more iovecs than msg
+        if (n == 0 || nmsg + 2 > LINE_IOVMAX) {
+            lb_writevn(fileno(fp), out, nout);
+            lb_writevn(pipefd, msg, nmsg);
+            nout = nmsg = 0;
+        }
+        if (n == 0)
+            return lines;
+    }
+}
@@ -0,0 +1,606 @@
+/*
+* @Author: Yinlong Su
+* @Date:   2026-10-19 20:37:15
+* @Last Modified by:   Yinlong Su
+* @Last Modified time: 2026-10-19 20:37:15
+*
+* File:         soak.c
+* Description:  Soak and fault injection test C file
+*/
+
+#include "echotime.h"
+#include <sys/resource.h>
+#include <dirent.h>
+#include <stddef.h>
+
+// client behaviors, assigned round robin over the client slots (-k)
+#define KIND_PING       0   // echo ping-pong, the latency probe
+#define KIND_SLOW       1   // sends all the time, reads 1KB every SLOW_PERIOD
+#define KIND_HALF       2   // sends a line, Shutdown(SHUT_WR), reads until EOF
+#define KIND_RST        3   // sends a burst and resets the connection
+#define KIND_TIME       4   // TIME Service subscriber, expects a line every 5 seconds
+#define KIND_CHURN      5   // connects and closes at once
+#define NKIND           6
+
+// client states
+#define CS_CLOSED       0
+#define CS_CONNECTING   1
+#define CS_ACTIVE       2
+
+// timing in milliseconds
+#define PING_PERIOD     100
+#define PING_TIMEOUT    10000   // also the connect timeout
+#define SLOW_PERIOD     5000
+#define HALF_PERIOD     1000
+#define RST_PERIOD      1000
+#define TICK_TIMEOUT    10000   // twice the TIME Service period
+#define CHURN_PERIOD    100
+#define RETRY_PERIOD    1000
+
+#define PING_LINE       "soak ping 0123456789abcdef\n"
+#define BURST_SIZE      65536
+#define MAX_RTTS        65536   // ping round trips kept per sample
+
+#define SOAK_GROWTH     0.1     // relative growth that fails the run
+#define SOAK_MINSAMPLES 6       // samples needed for a verdict
+
+struct client {
+    int         kind;
+    int         state;
+    uint64_t    due;        // time of the next action
+    uint64_t    sent;       // send time of the ping in flight, 0 if none
+    uint64_t    tick;       // deadline of the next daytime line, 0 if none
+};
+
+struct sample {
+    double      t;          // seconds since start
+    double      rss;        // server VmRSS in KB
+    double      threads;    // server threads
+    double      fds;        // server open fds
+    double      p99;        // ping round trip 99th percentile in ms
+    double      stall;      // age of the oldest ping in flight in ms
+};
+
+static const char   *kind_name[NKIND] = { "ping", "slow", "half", "rst", "time", "churn" };
+
+static struct sockaddr_in   servaddr;
+static struct client        *cl;
+static struct pollfd        *pv;
+
+static int          kinds[NKIND], nkinds;
+static double       rtts[MAX_RTTS];
+static int          nrtts, npings, ntimeouts, nticks, nmissed;
+static long         nconnects, nerrors, totalmissed;
+static char         burst[BURST_SIZE];
+
+/* --------------------------------------------------------------------------
+ *  now_ms
+ *
+ *  Clock function
+ *
+ *  @param  : void
+ *  @return : uint64_t (monotonic time in milliseconds)
+ * --------------------------------------------------------------------------
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* --------------------------------------------------------------------------
+ *  cl_close
+ *
+ *  Client close function
+ *
+ *  @param  : int       i (client slot)
+ *            int       reset (close with RST instead of FIN)
+ *            uint64_t  due (time to connect again)
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void cl_close(int i, int reset, uint64_t due) {
+    struct linger lg;
+
+    if (pv[i].fd >= 0) {
+        if (reset) {
+            lg.l_onoff  = 1;
+            lg.l_linger = 0;
+            setsockopt(pv[i].fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        close(pv[i].fd);
+    }
+    pv[i].fd     = -1;
+    pv[i].events = 0;
+    cl[i].state  = CS_CLOSED;
+    cl[i].sent   = 0;
+    cl[i].due    = due;
+}
+
+/* --------------------------------------------------------------------------
+ *  cl_connect
+ *
+ *  Client connect function
+ *
+ *  @param  : int       i (client slot)
+ *            uint64_t  now
+ *  @return : void
+ *
+ *  Start a nonblocking connect to the ECHO Service, or to the TIME
+ *  Service for KIND_TIME
+ * --------------------------------------------------------------------------
+ */
+static void cl_connect(int i, uint64_t now) {
+    int                 fd, flag;
+    struct sockaddr_in  addr = servaddr;
+
+    addr.sin_port = htons(cl[i].kind == KIND_TIME ? PORT_TIME : PORT_ECHO);
+
+    // reconnects do not restart the tick timer, only a daytime line does
+    if (cl[i].kind == KIND_TIME && cl[i].tick == 0)
+        cl[i].tick = now + TICK_TIMEOUT;
+
+    // use socket rather than Socket, running out of fds is not fatal here
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        nerrors++;
+        cl[i].due = now + RETRY_PERIOD;
+        return;
+    }
+    flag = Fcntl(fd, F_GETFL, 0);
+    Fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+
+    pv[i].fd     = fd;
+    pv[i].events = POLLOUT;
+    cl[i].state  = CS_CONNECTING;
+    cl[i].due    = now + PING_TIMEOUT;
+    nconnects++;
+
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        nerrors++;
+        cl_close(i, 0, now + RETRY_PERIOD);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  cl_connected
+ *
+ *  Client connection established function
+ *
+ *  @param  : int       i (client slot)
+ *            uint64_t  now
+ *  @return : void
+ *
+ *  Start the behavior of the client
+ * --------------------------------------------------------------------------
+ */
+static void cl_connected(int i, uint64_t now) {
+    int fd = pv[i].fd;
+
+    cl[i].state = CS_ACTIVE;
+    switch (cl[i].kind) {
+    case KIND_PING:
+        pv[i].events = POLLIN;
+        cl[i].due = now;
+        break;
+    case KIND_SLOW:
+        // never POLLIN, the data waiting would wake poll() up at once
+        pv[i].events = POLLOUT;
+        cl[i].due = now + SLOW_PERIOD;
+        break;
+    case KIND_HALF:
+        write(fd, PING_LINE, strlen(PING_LINE));
+        shutdown(fd, SHUT_WR);
+        pv[i].events = POLLIN;
+        cl[i].due = UINT64_MAX;
+        break;
+    case KIND_RST:
+        // reset with most of the burst still unread by the server
+        write(fd, burst, BURST_SIZE);
+        cl_close(i, 1, now + RST_PERIOD);
+        break;
+    case KIND_TIME:
+        // no action of its own, the tick timer is checked in main
+        pv[i].events = POLLIN;
+        cl[i].due = UINT64_MAX;
+        break;
+    case KIND_CHURN:
+        cl_close(i, 0, now + CHURN_PERIOD);
+        break;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  cl_event
+ *
+ *  Client poll event function
+ *
+ *  @param  : int       i (client slot)
+ *            uint64_t  now
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void cl_event(int i, uint64_t now) {
+    int         err = 0, k;
+    ssize_t     n;
+    socklen_t   len = sizeof(err);
+    char        buf[4096];
+
+    if (cl[i].state == CS_CONNECTING) {
+        getsockopt(pv[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            nerrors++;
+            cl_close(i, 0, now + RETRY_PERIOD);
+        }
+        else
+            cl_connected(i, now);
+        return;
+    }
+
+    if (cl[i].kind == KIND_SLOW) {
+        // fill the socket until it would block
+        while (write(pv[i].fd, burst, sizeof(buf)) > 0)
+            ;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            nerrors++;
+            cl_close(i, 0, now + RETRY_PERIOD);
+        }
+        return;
+    }
+
+    if ((n = read(pv[i].fd, buf, sizeof(buf))) > 0) {
+        // a ping is answered once its newline is back
+        if (cl[i].kind == KIND_PING && cl[i].sent != 0 && memchr(buf, '\n', n) != NULL) {
+            if (nrtts < MAX_RTTS)
+                rtts[nrtts++] = now - cl[i].sent;
+            npings++;
+            cl[i].sent = 0;
+            cl[i].due  = now + PING_PERIOD;
+        }
+        // a daytime line restarts the tick timer
+        if (cl[i].kind == KIND_TIME && memchr(buf, '\n', n) != NULL) {
+            nticks++;
+            cl[i].tick = now + TICK_TIMEOUT;
+        }
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    // EOF is the expected end only for the half-closing client
+    if (n < 0 || cl[i].kind != KIND_HALF)
+        nerrors++;
+    k = (cl[i].kind == KIND_HALF) ? HALF_PERIOD : RETRY_PERIOD;
+    cl_close(i, 0, now + k);
+}
+
+/* --------------------------------------------------------------------------
+ *  cl_timer
+ *
+ *  Client timer function
+ *
+ *  @param  : int       i (client slot)
+ *            uint64_t  now
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void cl_timer(int i, uint64_t now) {
+    ssize_t n;
+    char    buf[1024];
+
+    if (cl[i].state == CS_CLOSED) {
+        cl_connect(i, now);
+        return;
+    }
+    if (cl[i].state == CS_CONNECTING) {
+        // the server does not even accept any more
+        nerrors++;
+        cl_close(i, 0, now + RETRY_PERIOD);
+        return;
+    }
+
+    if (cl[i].kind == KIND_PING) {
+        if (cl[i].sent == 0) {
+            // the line is far below the socket buffer size
+            if (write(pv[i].fd, PING_LINE, strlen(PING_LINE)) < 0) {
+                nerrors++;
+                cl_close(i, 0, now + RETRY_PERIOD);
+                return;
+            }
+            cl[i].sent = now;
+            cl[i].due  = now + PING_TIMEOUT;
+        }
+        else {
+            // no answer, count it with the full timeout as its latency
+            if (nrtts < MAX_RTTS)
+                rtts[nrtts++] = PING_TIMEOUT;
+            ntimeouts++;
+            cl_close(i, 0, now + RETRY_PERIOD);
+        }
+    }
+    else if (cl[i].kind == KIND_SLOW) {
+        n = read(pv[i].fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            nerrors++;
+            cl_close(i, 0, now + RETRY_PERIOD);
+            return;
+        }
+        cl[i].due = now + SLOW_PERIOD;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  dcmp
+ *
+ *  qsort compare function for doubles
+ * --------------------------------------------------------------------------
+ */
+static int dcmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* --------------------------------------------------------------------------
+ *  proc_sample
+ *
+ *  Server resource sampling function
+ *
+ *  @param  : pid_t             pid
+ *            struct sample*    s
+ *  @return : int (0 on success, -1 if the server is gone)
+ *
+ *  Read VmRSS and Threads from /proc/<pid>/status and count the entries
+ *  of /proc/<pid>/fd (Linux only)
+ * --------------------------------------------------------------------------
+ */
+static int proc_sample(pid_t pid, struct sample *s) {
+    char            path[64], line[256];
+    FILE            *fp;
+    DIR             *dp;
+    struct dirent   *de;
+    long            v;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    s->rss = s->threads = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &v) == 1)
+            s->rss = v;
+        else if (sscanf(line, "Threads: %ld", &v) == 1)
+            s->threads = v;
+    }
+    fclose(fp);
+
+    // e.g. a binary status file (Solaris), nothing to measure is no pass
+    if (s->rss < 0 || s->threads < 0)
+        err_quit("soak: no VmRSS or Threads in %s, only Linux /proc is supported", path);
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    if ((dp = opendir(path)) == NULL)
+        return -1;
+    s->fds = 0;
+    while ((de = readdir(dp)) != NULL)
+        if (de->d_name[0] != '.')
+            s->fds++;
+    closedir(dp);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  check_growth
+ *
+ *  Unbounded growth check function
+ *
+ *  @param  : const char*       name
+ *            struct sample*    s
+ *            int               n (number of samples)
+ *            size_t            off (offset of the metric in struct sample)
+ *            double            floor (growth always tolerated)
+ *  @return : int (1 if the metric grew, 0 otherwise)
+ *
+ *  The first third of the run is warmup. The minimum of the last third is
+ *  compared with the minimum of the middle one. Churn only adds peaks, a
+ *  leak raises the level the metric falls back to.
+ * --------------------------------------------------------------------------
+ */
+static int check_growth(const char *name, struct sample *s, int n, size_t off, double floor) {
+    double  v, mid = -1, last = -1;
+    int     i, w = n / 3;
+
+    for (i = w; i < n; i++) {
+        v = *(double *)((char *)&s[i] + off);
+        if (i < 2 * w && (mid < 0 || v < mid))
+            mid = v;
+        if (i >= 2 * w && (last < 0 || v < last))
+            last = v;
+    }
+
+    if (last - mid > floor && last - mid > SOAK_GROWTH * mid) {
+        printf("[SOAK] FAIL %-8s %.1f -> %.1f\n", name, mid, last);
+        return 1;
+    }
+    printf("[SOAK] ok   %-8s %.1f -> %.1f\n", name, mid, last);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  main
+ *
+ *  Entry function
+ *
+ *  @param  : int   argc
+ *            char  **argv
+ *  @return : int (0 if no resource grew without bound, 1 otherwise)
+ *  @usage  : ./soak [-c clients] [-d seconds] [-i seconds] [-k kind,...]
+ *                   <Server IP> <Server pid>
+ *
+ *  Process:
+ *    01. Raise the fd limit and start the clients, the behaviors given by
+ *        -k (default: ping,slow,half,rst,time,churn) are assigned round
+ *        robin;
+ *    02. Drive all the clients with one poll() loop;
+ *    03. Every interval, sample the server's RSS, threads and fds from
+ *        /proc and the ping round trips, and print them. A ping counts in
+ *        the round trips once it is answered or timed out. The age of the
+ *        oldest ping still in flight is sampled apart, so a stalled server
+ *        shows up at once;
+ *    04. At the end, fail if any of them kept growing, or if a TIME
+ *        subscriber went TICK_TIMEOUT without a daytime line.
+ * --------------------------------------------------------------------------
+ */
+int main(int argc, char **argv) {
+    int             nclients = 1200, duration = 3600, interval = 10;
+    int             i, c, r, nsamples = 0, maxsamples, failed = 0, alive[NKIND];
+    pid_t           pid;
+    uint64_t        start, now, next_sample;
+    struct rlimit   rl;
+    struct sample   *samples, *s;
+    char            *p;
+
+    for (nkinds = 0; nkinds < NKIND; nkinds++)
+        kinds[nkinds] = nkinds;
+
+    while ((c = getopt(argc, argv, "c:d:i:k:")) != -1) {
+        switch (c) {
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'k':
+            for (nkinds = 0, p = strtok(optarg, ","); p != NULL; p = strtok(NULL, ",")) {
+                for (i = 0; i < NKIND; i++)
+                    if (strcmp(p, kind_name[i]) == 0)
+                        break;
+                if (i == NKIND || nkinds == NKIND)
+                    err_quit("soak: unknown client kind %s", p);
+                kinds[nkinds++] = i;
+            }
+            break;
+        default:
+            err_quit("usage: soak [-c clients] [-d seconds] [-i seconds] [-k kind,...] <Server IP> <Server pid>");
+        }
+    }
+    if (argc - optind != 2 || nclients < 1 || duration < 1 || interval < 1 || nkinds == 0)
+        err_quit("usage: soak [-c clients] [-d seconds] [-i seconds] [-k kind,...] <Server IP> <Server pid>");
+    if (duration / interval < SOAK_MINSAMPLES)
+        err_quit("soak: %d samples at least are needed, -d must be %d times -i or more",
+                 SOAK_MINSAMPLES, SOAK_MINSAMPLES);
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    Inet_pton(AF_INET, argv[optind], &servaddr.sin_addr);
+    pid = atoi(argv[optind + 1]);
+
+    // writes to reset connections are expected
+    Signal(SIGPIPE, SIG_IGN);
+
+    // 01. every client needs an fd
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(burst, 's', BURST_SIZE);
+    cl = Calloc(nclients, sizeof(struct client));
+    pv = Calloc(nclients, sizeof(struct pollfd));
+    maxsamples = duration / interval + 2;
+    samples = Calloc(maxsamples, sizeof(struct sample));
+
+    start = now_ms();
+    for (i = 0; i < nclients; i++) {
+        cl[i].kind = kinds[i % nkinds];
+        // spread the connects over the first second
+        cl_close(i, 0, start + (uint64_t)i * 1000 / nclients);
+    }
+    next_sample = start + interval * 1000;
+
+    printf("[SOAK] %d clients on %s, server pid %d, %d seconds, sample every %d seconds\n",
+           nclients, argv[optind], (int)pid, duration, interval);
+
+    for ( ; ; ) {
+        // 02. poll() ignores the closed slots (fd -1)
+        r = poll(pv, nclients, 50);
+        if (r < 0 && errno != EINTR)
+            err_sys("soak: poll error");
+
+        now = now_ms();
+        for (i = 0; i < nclients; i++) {
+            if (pv[i].fd >= 0 && r > 0 && pv[i].revents != 0)
+                cl_event(i, now);
+            if (now >= cl[i].due)
+                cl_timer(i, now);
+            // no daytime line for two periods, connected or not
+            if (cl[i].tick != 0 && now >= cl[i].tick) {
+                nmissed++;
+                totalmissed++;
+                cl[i].tick = now + TICK_TIMEOUT;
+            }
+        }
+
+        if (now < next_sample)
+            continue;
+        next_sample += interval * 1000;
+
+        // 03. sample
+        s = &samples[nsamples];
+        s->t = (now - start) / 1000.0;
+        if (proc_sample(pid, s) < 0) {
+            printf("[SOAK] FAIL server pid %d is gone\n", (int)pid);
+            exit(1);
+        }
+        s->stall = 0;
+        for (i = 0; i < nclients; i++)
+            if (cl[i].kind == KIND_PING && cl[i].sent != 0 && now - cl[i].sent > s->stall)
+                s->stall = now - cl[i].sent;
+        qsort(rtts, nrtts, sizeof(double), dcmp);
+        s->p99 = (nrtts > 0) ? rtts[nrtts * 99 / 100] : 0;
+
+        bzero(alive, sizeof(alive));
+        for (i = 0; i < nclients; i++)
+            if (cl[i].state == CS_ACTIVE)
+                alive[cl[i].kind]++;
+
+        printf("[SOAK] t=%6.0fs rss=%.0fKB threads=%.0f fds=%.0f ping p50=%.0fms p99=%.0fms max=%.0fms"
+               " stall=%.0fms n=%d timeouts=%d ticks=%d missed=%d connects=%ld errors=%ld",
+               s->t, s->rss, s->threads, s->fds, (nrtts > 0) ? rtts[nrtts / 2] : 0, s->p99,
+               (nrtts > 0) ? rtts[nrtts - 1] : 0, s->stall, npings, ntimeouts, nticks, nmissed,
+               nconnects, nerrors);
+        for (i = 0; i < NKIND; i++)
+            printf(" %s=%d", kind_name[i], alive[i]);
+        printf("\n");
+        fflush(stdout);
+
+        nrtts = npings = ntimeouts = nticks = nmissed = 0;
+        if (++nsamples == maxsamples || s->t >= duration)
+            break;
+    }
+
+    // 04. verdict, no verdict is a failure too
+    if (nsamples < SOAK_MINSAMPLES) {
+        printf("[SOAK] FAILED, too few samples for a verdict\n");
+        exit(1);
+    }
+    failed += check_growth("rss", samples, nsamples, offsetof(struct sample, rss), 1024);
+    failed += check_growth("threads", samples, nsamples, offsetof(struct sample, threads), 4);
+    failed += check_growth("fds", samples, nsamples, offsetof(struct sample, fds), 8);
+    failed += check_growth("p99", samples, nsamples, offsetof(struct sample, p99), 5);
+    failed += check_growth("stall", samples, nsamples, offsetof(struct sample, stall), PING_PERIOD);
+
+    // a TIME subscriber must get a line every period, growth or not
+    if (totalmissed > 0) {
+        printf("[SOAK] FAIL ticks    %ld times a TIME subscriber got no line for %d s\n",
+               totalmissed, TICK_TIMEOUT / 1000);
+        failed++;
+    }
+    else
+        printf("[SOAK] ok   ticks    no TIME subscriber missed a line\n");
+    printf("[SOAK] %s\n", failed ? "FAILED" : "PASSED");
+    exit(failed ? 1 : 0);
+}
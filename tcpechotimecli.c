@@ -106,7 +106,10 @@ int main(int argc, char **argv)
 {
     pid_t               childpid;
     int                 stat, pfd[2], c, r, i;
-    char                buf[PIPE_BUFFSIZE], pipe_str[PIPESTR_BUFFSIZE], ipaddr[IP_BUFFSIZE];
+    char                buf[PIPE_BUFFSIZE + 1], pipe_str[PIPESTR_BUFFSIZE], ipaddr[IP_BUFFSIZE];
+    char                *msg, *end;
+    size_t              len;
+    ssize_t             n;
     struct sockaddr_in  servaddr;
     struct hostent      *he;
 
@@ -191,6 +194,7 @@ int main(int argc, char **argv)
                 // this is parent process part
                 // close the write end of the pipe
                 close(pfd[1]);
+                len = 0;
 
                 for ( ; ; ) {
                     // in the for-loop, use
@@ -199,8 +203,6 @@ int main(int argc, char **argv)
                     FD_SET(STDIN_FILENO, &fds);
                     FD_SET(pfd[0], &fds);
 
-                    bzero(buf, sizeof(buf));
-
                     // need to use select rather than Select provided by Steven
                     // cos Steven's Select doesn't handle EINTR
                     r = select(pfd[0] + 1, &fds, NULL, NULL, NULL);
@@ -211,12 +213,29 @@ int main(int argc, char **argv)
                     }
 
                     if (FD_ISSET(pfd[0], &fds)) {
-                        if (Read(pfd[0], buf, PIPE_BUFFSIZE) != 0)
-                            // the pipe is readable, read the message and print
+                        // the pipe is closed by child process, print what is left
+                        // (e.g. an error message from stderr, ending in '\n') and exits
+                        if ((n = Read(pfd[0], buf + len, PIPE_BUFFSIZE - len)) == 0) {
+                            if (len > 0) {
+                                buf[len] = 0;
+                                printf(": %s", buf);
+                            }
+                            break;
+                        }
+
+                        // the pipe is readable, print every NUL terminated message,
+                        // a partial one waits for the next read unless it fills buf
+                        len += n;
+                        buf[len] = 0;
+                        for (msg = buf; (end = memchr(msg, 0, buf + len - msg)) != NULL; msg = end + 1)
+                            printf(": %s", msg);
+                        len = buf + len - msg;
+                        if (len == PIPE_BUFFSIZE) {
                             printf(": %s", buf);
+                            len = 0;
+                        }
                         else
-                            // the pipe is closed by child process, exits
-                            break;
+                            memmove(buf, msg, len);
                     }
                     if (FD_ISSET(STDIN_FILENO, &fds)) {
                         // the stdin is readable, just read the char and discard it!
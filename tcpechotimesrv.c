@@ -10,6 +10,28 @@
 
 #include "echotime.h"
 
+static void *evloop(void *arg);
+static void *balancer(void *arg);
+
+static void loop_add(struct evloop *, struct conn *);
+static int loop_pick(void);
+static ssize_t echo_read(int, struct linebuf *, char *, const char **, size_t *);
+
+static struct conn      *conns = NULL;  // connections served by this instance
+static int              nconns = 0, nparked = 0;
+static pthread_mutex_t  conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   conn_cond = PTHREAD_COND_INITIALIZER;
+
+// set while the main thread collects live connections for a handoff
+static volatile sig_atomic_t handoff_live = 0;
+
+static int linemode = 0;    // echo whole lines only (-l)
+static int nsampled = 0;    // connections seen by the trace sampler
+
+static struct evloop    loops[LOOP_MAX];    // ECHO event loops (-e)
+static int              nloops = 0;
+static double           conn_avgrate = 0;   // bytes per second of an average connection
+
 /* --------------------------------------------------------------------------
  *  sig_pipe
  *
@@ -30,6 +52,917 @@ void sig_pipe(int signo) {
     return;
 }
 
+/* --------------------------------------------------------------------------
+ *  sig_usr2
+ *
+ *  SIGUSR2 Signal Handler
+ *
+ *  @param  : int signo
+ *  @return : void
+ *
+ *  Ask the main thread to dump the trace samples, the dump itself is not
+ *  async-signal-safe
+ * --------------------------------------------------------------------------
+ */
+void sig_usr2(int signo) {
+    trace_dump_req = 1;
+    return;
+}
+
+/* --------------------------------------------------------------------------
+ *  sig_usr1
+ *
+ *  SIGUSR1 Signal Handler
+ *
+ *  @param  : int signo
+ *  @return : void
+ *
+ *  Does nothing, the signal is only sent to interrupt the select() of a
+ *  service thread so that it notices a pending handoff
+ * --------------------------------------------------------------------------
+ */
+void sig_usr1(int signo) {
+    return;
+}
+
+/* --------------------------------------------------------------------------
+ *  thread_create
+ *
+ *  Thread creation function, called by the main thread only
+ *
+ *  @param  : pthread_t*    tid
+ *            void*         (*func)(void *)
+ *            void*         arg
+ *  @return : void
+ *
+ *  Create the thread with SIGUSR2 blocked. The signal is sent to the
+ *  process and may go to any thread that does not block it, while only
+ *  the main thread's select() acts on it. SIGUSR1 stays unblocked since
+ *  it is sent to a given service thread with pthread_kill.
+ * --------------------------------------------------------------------------
+ */
+static void thread_create(pthread_t *tid, void *(*func)(void *), void *arg) {
+    sigset_t set, old;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    Pthread_create(tid, NULL, func, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_start
+ *
+ *  Connection startup function
+ *
+ *  @param  : int connfd
+ *            int service (SERVICE_ECHO or SERVICE_TIME)
+ *  @return : void
+ *  @see    : echoserv, timeserv, loop_pick
+ *
+ *  Record the connection and create a thread to serve it. The record is
+ *  linked and the thread id stored under conn_mutex, so the thread can
+ *  not remove the record before it is complete.
+ *  In event loop mode an ECHO connection goes to the least loaded event
+ *  loop instead, nonblocking. In sampling mode one of every trace_rate
+ *  connections is traced.
+ * --------------------------------------------------------------------------
+ */
+static void conn_start(int connfd, int service) {
+    struct conn *c = Malloc(sizeof(struct conn));
+    int         loop = -1, flag;
+
+    c->fd       = connfd;
+    c->service  = service;
+    c->parked   = 0;
+    c->prev     = NULL;
+    c->accepted = (trace_rate > 0 && nsampled++ % trace_rate == 0) ? trace_now() : 0;
+    c->loop     = -1;
+    c->moveto   = -1;
+    c->bytes    = c->lastbytes = 0;
+    c->rate     = 0;
+    c->lb       = NULL;
+    c->out      = NULL;
+    c->outcap   = c->outpos = c->outlen = 0;
+    c->closing  = 0;
+
+    Pthread_mutex_lock(&conn_mutex);
+    c->next = conns;
+    if (conns != NULL)
+        conns->prev = c;
+    conns = c;
+    nconns++;
+    if (service == SERVICE_ECHO && nloops > 0) {
+        if (linemode) {
+            c->lb = Malloc(sizeof(struct linebuf));
+            lb_init(c->lb, connfd);
+        }
+        flag = Fcntl(connfd, F_GETFL, 0);
+        Fcntl(connfd, F_SETFL, flag | FNDELAY);
+        c->loop = c->moveto = loop = loop_pick();
+        c->tid  = loops[loop].tid;
+        loop_add(&loops[loop], c);
+    }
+    else
+        thread_create(&c->tid, (service == SERVICE_ECHO) ? &echoserv : &timeserv, c);
+    Pthread_mutex_unlock(&conn_mutex);
+
+    if (loop >= 0)
+        printf("\n[SERVER] Echo Service connected (loop %d).\n", loop);
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_unlink
+ *
+ *  Remove a connection record from the list, conn_mutex must be held
+ *
+ *  @param  : struct conn* c
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void conn_unlink(struct conn *c) {
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    nconns--;
+    if (c->parked)
+        nparked--;
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_free
+ *
+ *  Free a connection record and its buffers, the fd is not touched
+ *
+ *  @param  : struct conn* c
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void conn_free(struct conn *c) {
+    free(c->lb);
+    free(c->out);
+    free(c);
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_finish
+ *
+ *  Connection termination function
+ *
+ *  @param  : struct conn* c
+ *  @return : void
+ *
+ *  Close the connection, drop its record and wake up the main thread in
+ *  case it is draining
+ * --------------------------------------------------------------------------
+ */
+static void conn_finish(struct conn *c) {
+    Close(c->fd);
+
+    Pthread_mutex_lock(&conn_mutex);
+    conn_unlink(c);
+    Pthread_cond_broadcast(&conn_cond);
+    Pthread_mutex_unlock(&conn_mutex);
+    conn_free(c);
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_park
+ *
+ *  Give a connection up for handoff
+ *
+ *  @param  : struct conn* c
+ *  @return : int (1 if parked, 0 if the handoff is already over)
+ *
+ *  A parked connection keeps its fd open and its record linked, the main
+ *  thread sends the fd to the new instance and then closes it. If the
+ *  handoff has finished meanwhile, the caller must go on serving.
+ * --------------------------------------------------------------------------
+ */
+static int conn_park(struct conn *c) {
+    int r;
+
+    Pthread_mutex_lock(&conn_mutex);
+    if ((r = handoff_live) != 0) {
+        c->parked = 1;
+        nparked++;
+        Pthread_cond_broadcast(&conn_cond);
+    }
+    Pthread_mutex_unlock(&conn_mutex);
+    return r;
+}
+
+/* --------------------------------------------------------------------------
+ *  park_all
+ *
+ *  Collect the live connections for handoff
+ *
+ *  @param  : void
+ *  @return : struct conn* (list of parked connections, already unlinked)
+ *
+ *  Raise handoff_live and interrupt every service thread with SIGUSR1
+ *  until all of them parked or HANDOFF_TIMEOUT passed. The signal is
+ *  repeated every second since a thread may miss it just before entering
+ *  select(). Threads that did not park in time (e.g. blocked in Writen)
+ *  stay here and are drained.
+ * --------------------------------------------------------------------------
+ */
+static struct conn *park_all(void) {
+    struct conn     *c, *next, *parked = NULL;
+    struct timespec ts;
+    time_t          deadline;
+
+    Pthread_mutex_lock(&conn_mutex);
+    handoff_live = 1;
+    deadline = time(NULL) + HANDOFF_TIMEOUT;
+    while (nparked < nconns && time(NULL) < deadline) {
+        for (c = conns; c != NULL; c = c->next)
+            if (!c->parked)
+                pthread_kill(c->tid, SIGUSR1);
+        ts.tv_sec  = time(NULL) + 1;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&conn_cond, &conn_mutex, &ts);
+    }
+    handoff_live = 0;
+
+    // move the parked records to a private list
+    for (c = conns; c != NULL; c = next) {
+        next = c->next;
+        if (c->parked) {
+            conn_unlink(c);
+            c->next = parked;
+            parked = c;
+        }
+    }
+    Pthread_mutex_unlock(&conn_mutex);
+    return parked;
+}
+
+/* --------------------------------------------------------------------------
+ *  loop_init
+ *
+ *  Event loop startup function
+ *
+ *  @param  : int n (number of event loops)
+ *  @return : void
+ *  @see    : evloop, balancer
+ *
+ *  Create n event loop threads for the ECHO Service, and the balancer
+ *  thread which moves connections between them
+ * --------------------------------------------------------------------------
+ */
+static void loop_init(int n) {
+    int         i, flag;
+    pthread_t   tid;
+
+    for (i = 0; i < n; i++) {
+        struct evloop *lp = &loops[i];
+
+        lp->id       = i;
+        lp->incoming = NULL;
+        lp->moving   = 0;
+        lp->load     = 0;
+        lp->nconn    = 0;
+        Pthread_mutex_init(&lp->mutex, NULL);
+
+        // a full self-pipe already does its job, never block on it
+        Pipe(lp->wakefd);
+        flag = Fcntl(lp->wakefd[0], F_GETFL, 0);
+        Fcntl(lp->wakefd[0], F_SETFL, flag | FNDELAY);
+        flag = Fcntl(lp->wakefd[1], F_GETFL, 0);
+        Fcntl(lp->wakefd[1], F_SETFL, flag | FNDELAY);
+
+        lp->cap = 64;
+        lp->n   = 1;
+        lp->pv  = Malloc(lp->cap * sizeof(struct pollfd));
+        lp->cv  = Malloc(lp->cap * sizeof(struct conn *));
+        lp->pv[0].fd     = lp->wakefd[0];
+        lp->pv[0].events = POLLIN;
+
+        thread_create(&lp->tid, &evloop, lp);
+    }
+    nloops = n;
+    thread_create(&tid, &balancer, NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  loop_add
+ *
+ *  Hand a connection to an event loop
+ *
+ *  @param  : struct evloop*    lp
+ *            struct conn*      c
+ *  @return : void
+ *
+ *  Queue the connection and wake the loop up, the loop thread adopts it
+ *  before its next poll()
+ * --------------------------------------------------------------------------
+ */
+static void loop_add(struct evloop *lp, struct conn *c) {
+    Pthread_mutex_lock(&lp->mutex);
+    c->lnext = lp->incoming;
+    lp->incoming = c;
+    Pthread_mutex_unlock(&lp->mutex);
+
+    write(lp->wakefd[1], "", 1);
+}
+
+/* --------------------------------------------------------------------------
+ *  loop_pick
+ *
+ *  Event loop placement function, conn_mutex must be held
+ *
+ *  @param  : void
+ *  @return : int (event loop for a new connection)
+ *
+ *  Pick the loop with the lowest byte rate, then the fewest connections.
+ *  Its load is raised by an average connection at once, so a burst of
+ *  accepts between two rebalancing rounds is spread over the loops.
+ * --------------------------------------------------------------------------
+ */
+static int loop_pick(void) {
+    int i, best = 0;
+
+    for (i = 1; i < nloops; i++)
+        if (loops[i].load < loops[best].load
+            || (loops[i].load == loops[best].load && loops[i].nconn < loops[best].nconn))
+            best = i;
+
+    loops[best].load += conn_avgrate;
+    loops[best].nconn++;
+    return best;
+}
+
+/* --------------------------------------------------------------------------
+ *  loop_own
+ *
+ *  Put a connection into the poll set, called by the loop thread only
+ *
+ *  @param  : struct evloop*    lp
+ *            struct conn*      c
+ *  @return : void
+ * --------------------------------------------------------------------------
+ */
+static void loop_own(struct evloop *lp, struct conn *c) {
+    if (lp->n == lp->cap) {
+        lp->cap *= 2;
+        if ((lp->pv = realloc(lp->pv, lp->cap * sizeof(struct pollfd))) == NULL
+            || (lp->cv = realloc(lp->cv, lp->cap * sizeof(struct conn *))) == NULL)
+            err_sys("loop_own: realloc error");
+    }
+    lp->pv[lp->n].fd     = c->fd;
+    lp->pv[lp->n].events = (c->outpos < c->outlen) ? POLLOUT : POLLIN;
+    lp->cv[lp->n]        = c;
+    lp->n++;
+}
+
+/* --------------------------------------------------------------------------
+ *  loop_drop
+ *
+ *  Take a connection out of the poll set, called by the loop thread only
+ *
+ *  @param  : struct evloop*    lp
+ *            int               i (index in the poll set)
+ *  @return : void
+ *
+ *  The last entry fills the hole, so the set must be walked backwards
+ *  when dropping during a walk
+ * --------------------------------------------------------------------------
+ */
+static void loop_drop(struct evloop *lp, int i) {
+    lp->n--;
+    lp->pv[i] = lp->pv[lp->n];
+    lp->cv[i] = lp->cv[lp->n];
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_flush
+ *
+ *  Send the pending output of an event loop connection
+ *
+ *  @param  : struct conn* c
+ *  @return : int (0 on success, even if some output is still pending,
+ *            -1 on a write error)
+ * --------------------------------------------------------------------------
+ */
+static int conn_flush(struct conn *c) {
+    ssize_t n;
+
+    if ((n = write(c->fd, c->out + c->outpos, c->outlen - c->outpos)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        n = 0;
+    }
+    TRACE(write, c->fd);
+
+    c->outpos += n;
+    if (c->outpos == c->outlen)
+        c->outpos = c->outlen = 0;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  conn_send
+ *
+ *  Send data to an event loop connection without pending output
+ *
+ *  @param  : struct conn*  c
+ *            const char*   data
+ *            size_t        len
+ *  @return : int (0 on success, -1 on a write error)
+ *
+ *  Write as much as the socket takes and keep the rest as pending output
+ * --------------------------------------------------------------------------
+ */
+static int conn_send(struct conn *c, const char *data, size_t len) {
+    ssize_t n;
+
+    if (len == 0)
+        return 0;
+    if ((n = write(c->fd, data, len)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        n = 0;
+    }
+    TRACE(write, c->fd);
+
+    if ((size_t)n < len) {
+        if (len - n > c->outcap) {
+            free(c->out);
+            c->outcap = len - n;
+            c->out = Malloc(c->outcap);
+        }
+        memcpy(c->out, data + n, len - n);
+        c->outpos = 0;
+        c->outlen = len - n;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  loop_echo
+ *
+ *  Serve a ready connection of an event loop
+ *
+ *  @param  : struct evloop*    lp
+ *            int               i (index in the poll set)
+ *  @return : int (1 to keep the connection, 0 to close it)
+ *  @see    : echo_read, conn_send, conn_flush
+ *
+ *  The sockets are nonblocking. What the client does not take at once is
+ *  kept as pending output, and the connection is polled for POLLOUT and
+ *  not read until it is sent, so a client that stops reading holds at
+ *  most one read of data and never blocks the loop. Unlike str_echo, a
+ *  read or write error ends the connection, it would only make poll()
+ *  return at once again.
+ * --------------------------------------------------------------------------
+ */
+static int loop_echo(struct evloop *lp, int i) {
+    struct conn *c = lp->cv[i];
+    const char  *data;
+    size_t      len;
+    ssize_t     n;
+    int         r;
+    char        buf[ECHO_BUFFSIZE];
+
+    if (c->outpos < c->outlen)
+        r = conn_flush(c);
+    else {
+        n = echo_read(c->fd, c->lb, buf, &data, &len);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 1;
+        if (n == -1) {
+            printf("\n[SERVER] Client termination: socket read returned with value -1\n");
+            err_ret("evloop: read error");
+            return 0;
+        }
+        if (n == 0) {
+            printf("\n[SERVER] Client termination: socket read returned with value 0\n");
+            c->closing = 1;
+        }
+        c->bytes += n;
+        r = conn_send(c, data, len);
+    }
+
+    if (r < 0) {
+        printf("\n[SERVER] Client termination: socket write returned with value -1\n");
+        err_ret("evloop: write error");
+        return 0;
+    }
+    if (c->outpos < c->outlen) {
+        lp->pv[i].events = POLLOUT;
+        return 1;
+    }
+    lp->pv[i].events = POLLIN;
+    return !c->closing;
+}
+
+/* --------------------------------------------------------------------------
+ *  evloop
+ *
+ *  ECHO Service event loop thread function
+ *
+ *  @param  : void* arg (struct evloop)
+ *  @return : void*
+ *  @see    : loop_echo, balancer
+ *
+ *  Serve every connection of the loop with poll(). Each iteration:
+ *    01. Adopt the connections queued by loop_add;
+ *    02. Park the connections for a pending handoff;
+ *    03. Give up the connections the balancer moves to other loops;
+ *    04. Wait in poll() and serve every ready connection.
+ *  A connection holding a partial line (line mode) or pending output is
+ *  not parked, the new instance could not get them. It is moved along
+ *  with them. A connection keeps its moveto from being queued until it is
+ *  adopted, so the balancer leaves it alone meanwhile.
+ * --------------------------------------------------------------------------
+ */
+static void *evloop(void *arg) {
+    struct evloop   *lp = arg;
+    struct conn     *c, *next, *in, *out = NULL;
+    int             i, r;
+    char            dummy[64];
+
+    Pthread_detach(pthread_self());
+    if (trace_rate > 0)
+        trace_attach(0, -1);
+
+    for ( ; ; ) {
+        // 01. adopt, the balancer may pick them from now on
+        Pthread_mutex_lock(&lp->mutex);
+        in = lp->incoming;
+        lp->incoming = NULL;
+        Pthread_mutex_unlock(&lp->mutex);
+        if (in != NULL) {
+            Pthread_mutex_lock(&conn_mutex);
+            for (c = in; c != NULL; c = c->lnext)
+                c->moveto = -1;
+            Pthread_mutex_unlock(&conn_mutex);
+        }
+        for (c = in; c != NULL; c = next) {
+            next = c->lnext;
+            loop_own(lp, c);
+        }
+
+        // 02. park
+        if (handoff_live)
+            for (i = lp->n - 1; i >= 1; i--) {
+                c = lp->cv[i];
+                if ((c->lb == NULL || c->lb->start == c->lb->end)
+                    && c->outpos == c->outlen && !c->closing && conn_park(c))
+                    loop_drop(lp, i);
+            }
+
+        // 03. move, the target stays in moveto until the other loop adopts
+        // the connection. Hand over after unlocking since loop_add locks
+        // the target
+        Pthread_mutex_lock(&lp->mutex);
+        if (lp->moving) {
+            lp->moving = 0;
+            for (i = lp->n - 1; i >= 1; i--) {
+                c = lp->cv[i];
+                if (c->moveto < 0)
+                    continue;
+                loop_drop(lp, i);
+                c->lnext = out;
+                out = c;
+            }
+        }
+        Pthread_mutex_unlock(&lp->mutex);
+        for ( ; out != NULL; out = next) {
+            next = out->lnext;
+            loop_add(&loops[out->moveto], out);
+        }
+
+        // 04. poll, interrupted by SIGUSR1 for a handoff
+        if ((r = poll(lp->pv, lp->n, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err_sys("evloop: poll error");
+        }
+        TRACE(select_wake, -1);
+
+        if (lp->pv[0].revents & POLLIN)
+            while (read(lp->wakefd[0], dummy, sizeof(dummy)) > 0)
+                ;
+
+        for (i = lp->n - 1; i >= 1; i--) {
+            if (lp->pv[i].revents == 0)
+                continue;
+            c = lp->cv[i];
+            if (loop_echo(lp, i))
+                continue;
+            loop_drop(lp, i);
+            conn_finish(c);
+            printf("\n[SERVER] Echo Service finished (loop %d).\n", lp->id);
+        }
+    }
+    return (NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  rebalance
+ *
+ *  Event loop rebalancing function
+ *
+ *  @param  : void
+ *  @return : int (number of connections moved)
+ *
+ *  Process:
+ *    01. Update the byte rate of every connection, halving the weight of
+ *        the older rounds, and sum the rates of each loop;
+ *    02. While the busiest loop carries more than LOOP_IMBALANCE times
+ *        the average, move one of its connections to the idlest loop. The
+ *        one whose rate is closest to half the gap between the two loops
+ *        lowers the busier of them most. The move must lower it by the
+ *        same LOOP_IMBALANCE margin, otherwise e.g. three hot connections
+ *        on four loops would keep hopping to whichever loop is idle, and
+ *        a connection below LOOP_HOTRATE is never worth it.
+ *  At most nloops connections are moved per round.
+ * --------------------------------------------------------------------------
+ */
+static int rebalance(void) {
+    struct conn *c, *best;
+    double      load[LOOP_MAX], total = 0, gap, gain, bestgain;
+    int         nconn[LOOP_MAX], i, b, m, k, n = 0, moved = 0;
+
+    bzero(load, sizeof(load));
+    bzero(nconn, sizeof(nconn));
+
+    Pthread_mutex_lock(&conn_mutex);
+    for (c = conns; c != NULL; c = c->next) {
+        if (c->loop < 0 || c->parked)
+            continue;
+        c->rate = (c->rate + (double)(c->bytes - c->lastbytes) / LOOP_INTERVAL) / 2;
+        c->lastbytes = c->bytes;
+        load[c->loop] += c->rate;
+        nconn[c->loop]++;
+        total += c->rate;
+        n++;
+    }
+    conn_avgrate = (n > 0) ? total / n : 0;
+
+    for (k = 0; k < nloops; k++) {
+        for (b = m = 0, i = 1; i < nloops; i++) {
+            if (load[i] > load[b])
+                b = i;
+            if (load[i] < load[m])
+                m = i;
+        }
+        if (load[b] < LOOP_MINRATE || load[b] <= LOOP_IMBALANCE * total / nloops)
+            break;
+
+        gap = load[b] - load[m];
+        best = NULL;
+        bestgain = load[b] * (1 - 1 / LOOP_IMBALANCE);
+        for (c = conns; c != NULL; c = c->next) {
+            // a connection with moveto set is queued, in no poll set
+            if (c->loop != b || c->parked || c->moveto >= 0 || c->rate < LOOP_HOTRATE)
+                continue;
+            // the busier of the two loops goes down by this much
+            gain = min(c->rate, gap - c->rate);
+            if (gain >= bestgain) {
+                best = c;
+                bestgain = gain;
+            }
+        }
+        if (best == NULL)
+            break;
+
+        // the source loop gives it up to loop m (its new c->loop)
+        Pthread_mutex_lock(&loops[b].mutex);
+        best->moveto = m;
+        loops[b].moving = 1;
+        Pthread_mutex_unlock(&loops[b].mutex);
+        write(loops[b].wakefd[1], "", 1);
+
+        best->loop = m;
+        best->tid  = loops[m].tid;
+        load[b] -= best->rate;
+        load[m] += best->rate;
+        nconn[b]--;
+        nconn[m]++;
+        moved++;
+    }
+
+    for (i = 0; i < nloops; i++) {
+        loops[i].load  = load[i];
+        loops[i].nconn = nconn[i];
+    }
+    Pthread_mutex_unlock(&conn_mutex);
+    return moved;
+}
+
+/* --------------------------------------------------------------------------
+ *  balancer
+ *
+ *  Event loop balancer thread function
+ *
+ *  @param  : void* arg (unused)
+ *  @return : void*
+ *  @see    : rebalance
+ *
+ *  Rebalance the event loops every LOOP_INTERVAL seconds, except during a
+ *  handoff
+ * --------------------------------------------------------------------------
+ */
+static void *balancer(void *arg) {
+    int moved;
+
+    Pthread_detach(pthread_self());
+
+    for ( ; ; ) {
+        sleep(LOOP_INTERVAL);
+        if (handoff_live)
+            continue;
+        if ((moved = rebalance()) > 0)
+            printf("\n[SERVER] Rebalance: %d connections moved.\n", moved);
+    }
+    return (NULL);
+}
+
+/* --------------------------------------------------------------------------
+ *  handoff
+ *
+ *  Hand the server over to a new instance
+ *
+ *  @param  : int ctlfd (connected handoff control socket)
+ *            int listenechofd
+ *            int listentimefd
+ *  @return : int (0 if the new instance took over, -1 on error)
+ *  @see    : takeover
+ *
+ *  Process:
+ *    01. Check that the peer runs as our user and read the request byte
+ *        (HANDOFF_LISTEN or HANDOFF_LIVE), waiting HANDOFF_REQWAIT ms at
+ *        most since accepts stop meanwhile;
+ *    02. Send both listening sockets, the kernel keeps queueing new
+ *        connections on them so none is refused during the swap;
+ *    03. For HANDOFF_LIVE, park the live connections and send them in
+ *        batches of HANDOFF_BATCH along with their service type.
+ *  Only a failure in 01 or 02 leaves this instance serving.
+ * --------------------------------------------------------------------------
+ */
+static int handoff(int ctlfd, int listenechofd, int listentimefd) {
+    char                req;
+    int                 fds[HANDOFF_BATCH], n = 0, total = 0, flag;
+    struct conn         *c, *next, *parked = NULL;
+    struct handoff_hdr  hdr;
+    struct timeval      tv;
+
+    if (handoff_peer(ctlfd) < 0) {
+        err_ret("handoff: peer refused");
+        close(ctlfd);
+        return -1;
+    }
+
+    tv.tv_sec  = 0;
+    tv.tv_usec = HANDOFF_REQWAIT * 1000;
+    Setsockopt(ctlfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (read(ctlfd, &req, 1) != 1 || (req != HANDOFF_LISTEN && req != HANDOFF_LIVE)) {
+        printf("\n[SERVER] Handoff: bad request, ignored\n");
+        close(ctlfd);
+        return -1;
+    }
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.nfds = 2;
+    hdr.more = (req == HANDOFF_LIVE);
+    fds[0] = listenechofd;  hdr.service[0] = SERVICE_ECHO;
+    fds[1] = listentimefd;  hdr.service[1] = SERVICE_TIME;
+    if (handoff_send(ctlfd, &hdr, fds) < 0) {
+        err_ret("handoff: listening sockets send error"); // keep serving
+        close(ctlfd);
+        return -1;
+    }
+
+    // the new instance accepts from now on
+    Close(listenechofd);
+    Close(listentimefd);
+
+    if (req == HANDOFF_LIVE) {
+        parked = park_all();
+        bzero(&hdr, sizeof(hdr));
+        for (c = parked; ; c = c->next) {
+            if (c != NULL) {
+                // an event loop socket is nonblocking, the new instance
+                // may serve it with a thread
+                if (c->loop >= 0) {
+                    flag = Fcntl(c->fd, F_GETFL, 0);
+                    Fcntl(c->fd, F_SETFL, flag & ~FNDELAY);
+                }
+                fds[n] = c->fd;
+                hdr.service[n++] = c->service;
+            }
+            if (n == HANDOFF_BATCH || c == NULL) {
+                hdr.nfds = n;
+                hdr.more = (c != NULL);
+                if (handoff_send(ctlfd, &hdr, fds) < 0) {
+                    err_ret("handoff: connections send error");
+                    break;
+                }
+                total += n;
+                n = 0;
+            }
+            if (c == NULL)
+                break;
+        }
+        // the new instance holds its own copies now
+        for (c = parked; c != NULL; c = next) {
+            next = c->next;
+            Close(c->fd);
+            conn_free(c);
+        }
+    }
+    Close(ctlfd);
+
+    printf("\n[SERVER] Handoff done, %d connections passed.\n", total);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  takeover
+ *
+ *  Take the server over from the running instance
+ *
+ *  @param  : int   mode (HANDOFF_LISTEN or HANDOFF_LIVE)
+ *            int*  listenechofd
+ *            int*  listentimefd
+ *  @return : int (control socket the live connections follow on, -1 if none)
+ *  @see    : handoff, takeover_recv
+ *
+ *  Receive the listening sockets from the running server over
+ *  HANDOFF_PATH, held by a process of the same user. The message must
+ *  carry exactly the ECHO and the TIME listener, in this order. For
+ *  HANDOFF_LIVE the old server parks its connections next, which takes
+ *  up to HANDOFF_TIMEOUT, so they are collected by takeover_recv from the
+ *  main loop while this instance already accepts.
+ * --------------------------------------------------------------------------
+ */
+static int takeover(int mode, int *listenechofd, int *listentimefd) {
+    char                req = mode;
+    int                 ctlfd, fds[HANDOFF_BATCH], n, i;
+    struct handoff_hdr  hdr;
+
+    if ((ctlfd = handoff_connect(HANDOFF_PATH)) < 0)
+        err_sys("takeover: no running server at %s", HANDOFF_PATH);
+    // anybody may bind the path in /tmp first, take sockets from our user only
+    if (handoff_peer(ctlfd) < 0)
+        err_quit("takeover: %s is not held by a server of this user", HANDOFF_PATH);
+    Writen(ctlfd, &req, 1);
+
+    if ((n = handoff_recv(ctlfd, &hdr, fds)) < 0)
+        err_sys("takeover: listening sockets receive error");
+    if (n != 2 || hdr.service[0] != SERVICE_ECHO || hdr.service[1] != SERVICE_TIME) {
+        for (i = 0; i < n; i++)
+            close(fds[i]);
+        err_quit("takeover: unexpected listening sockets message");
+    }
+    *listenechofd = fds[0];
+    *listentimefd = fds[1];
+
+    printf("\n[SERVER] Took the listening sockets over from the running server.\n");
+    if (hdr.more)
+        return ctlfd;
+    Close(ctlfd);
+    return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  takeover_recv
+ *
+ *  Receive a batch of live connections from the previous instance
+ *
+ *  @param  : int ctlfd (readable control socket returned by takeover)
+ *  @return : int (1 if more batches follow, 0 if ctlfd has been closed)
+ *
+ *  Each received connection gets a new service thread, or an event loop
+ * --------------------------------------------------------------------------
+ */
+static int takeover_recv(int ctlfd) {
+    int                 fds[HANDOFF_BATCH], n, i;
+    struct handoff_hdr  hdr;
+    static int          total = 0;
+
+    if ((n = handoff_recv(ctlfd, &hdr, fds)) < 0) {
+        err_ret("takeover_recv: connections receive error");
+        hdr.more = 0;
+    }
+    for (i = 0; i < n; i++)
+        conn_start(fds[i], hdr.service[i]);
+    total += max(n, 0);
+
+    if (hdr.more)
+        return 1;
+    Close(ctlfd);
+    printf("\n[SERVER] Took over from the running server, %d connections received.\n", total);
+    return 0;
+}
+
 /* --------------------------------------------------------------------------
  *  main
  *
@@ -38,92 +971,186 @@ void sig_pipe(int signo) {
  *  @param  : int   argc
  *            char  **argv
  *  @return : int
- *  @see    : echoserv, timeserv
- *  @usage  : ./server [&]
+ *  @see    : conn_start, handoff, takeover, takeover_recv
+ *  @usage  : ./server [-l] [-e loops] [-t rate] [-r | -R] [&]
  *
  *  Server entry function, listening to the service ports and creating
  *  threads to handle client requests.
+ *
+ *  With -r the server takes the listening sockets over from the running
+ *  server, which then finishes its connections and exits. With -R the
+ *  live connections are taken over as well. With -l the ECHO Service
+ *  sends back complete lines only. With -e the ECHO connections are served
+ *  by a fixed number of event loops, balanced by their byte rates. With
+ *  -t the stages of one of every rate connections are recorded, SIGUSR2
+ *  dumps them (see trace.c).
  * --------------------------------------------------------------------------
  */
 int main(int argc, char **argv) {
     const int   on = 1;
-    int         listenechofd, listentimefd, *connfd, maxfdp1, flag, r;
-    pthread_t   tid;
+    int         listenechofd, listentimefd, handofffd, ctlfd, connfd, maxfdp1, flag, r, c;
+    int         restart = 0, nloop = 0, takeoverfd = -1;
     socklen_t   clilen;
     fd_set      rset;
     struct sockaddr_in cliaddr, servaddr;
+    struct sigaction   act;
+
+    while ((c = getopt(argc, argv, "le:t:rR")) != -1) {
+        switch (c) {
+        case 'l':
+            linemode = 1;
+            break;
+        case 'e':
+            if ((nloop = atoi(optarg)) < 1 || nloop > LOOP_MAX)
+                err_quit("server: number of event loops must be 1 to %d", LOOP_MAX);
+            break;
+        case 't':
+            if ((trace_rate = atoi(optarg)) < 1)
+                err_quit("server: trace sampling rate must be positive");
+            // the main thread is always recorded
+            trace_attach(0, -1);
+            break;
+        case 'r':
+            restart = HANDOFF_LISTEN;
+            break;
+        case 'R':
+            restart = HANDOFF_LIVE;
+            break;
+        default:
+            err_quit("usage: server [-l] [-e loops] [-t rate] [-r | -R]");
+        }
+    }
 
-    // use function sig_pipe as SIGPIPE handler
+    // use function sig_pipe as SIGPIPE handler and function sig_usr2 as SIGUSR2 handler
     Signal(SIGPIPE, sig_pipe);
+    Signal(SIGUSR2, sig_usr2);
 
-    listenechofd = Socket(AF_INET, SOCK_STREAM, 0);
-    listentimefd = Socket(AF_INET, SOCK_STREAM, 0);
+    // function sig_usr1 as SIGUSR1 handler, without SA_RESTART as Signal would set,
+    // a service thread blocked in read() must see EINTR to notice a handoff
+    bzero(&act, sizeof(act));
+    act.sa_handler = sig_usr1;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGUSR1, &act, NULL) < 0)
+        err_sys("sigaction error");
 
-    // set both listening socket to nonblocking
-    flag = Fcntl(listenechofd, F_GETFL, 0);
-    Fcntl(listenechofd, F_SETFL, flag | FNDELAY);
+    // event loops first, the connections taken over may go to them
+    if (nloop > 0)
+        loop_init(nloop);
 
-    flag = Fcntl(listentimefd, F_GETFL, 0);
-    Fcntl(listentimefd, F_SETFL, flag | FNDELAY);
+    if (restart)
+        // the listening sockets are already bound, nonblocking and listening,
+        // the live connections arrive on takeoverfd later
+        takeoverfd = takeover(restart, &listenechofd, &listentimefd);
+    else {
+        listenechofd = Socket(AF_INET, SOCK_STREAM, 0);
+        listentimefd = Socket(AF_INET, SOCK_STREAM, 0);
 
-    // turn on SO_REUSEADDR and SO_KEEPALIVE in socket option
-    // then bind and listen
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        // set both listening socket to nonblocking
+        flag = Fcntl(listenechofd, F_GETFL, 0);
+        Fcntl(listenechofd, F_SETFL, flag | FNDELAY);
 
-    servaddr.sin_port = htons(PORT_ECHO);
-    Setsockopt(listenechofd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    Setsockopt(listenechofd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
-    Bind(listenechofd, (SA *)&servaddr, sizeof(servaddr));
-    Listen(listenechofd, LISTENQ);
+        flag = Fcntl(listentimefd, F_GETFL, 0);
+        Fcntl(listentimefd, F_SETFL, flag | FNDELAY);
 
-    servaddr.sin_port = htons(PORT_TIME);
-    Setsockopt(listentimefd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    Setsockopt(listentimefd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
-    Bind(listentimefd, (SA *)&servaddr, sizeof(servaddr));
-    Listen(listentimefd, LISTENQ);
+        // turn on SO_REUSEADDR and SO_KEEPALIVE in socket option
+        // then bind and listen
+        bzero(&servaddr, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    FD_ZERO(&rset);
-    maxfdp1 = max(listenechofd, listentimefd) + 1;
+        servaddr.sin_port = htons(PORT_ECHO);
+        Setsockopt(listenechofd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        Setsockopt(listenechofd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        Bind(listenechofd, (SA *)&servaddr, sizeof(servaddr));
+        Listen(listenechofd, LISTENQ);
+
+        servaddr.sin_port = htons(PORT_TIME);
+        Setsockopt(listentimefd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        Setsockopt(listentimefd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        Bind(listentimefd, (SA *)&servaddr, sizeof(servaddr));
+        Listen(listentimefd, LISTENQ);
+    }
+
+    // control socket the next instance connects to for a hot restart
+    handofffd = handoff_listen(HANDOFF_PATH);
+
+    maxfdp1 = max(max(max(listenechofd, listentimefd), handofffd), takeoverfd) + 1;
 
     // print out the server startup message
     printf("\n[SERVER] TCP EchoTime Server started.\n");
     printf("[SERVER]     Echo Service port=%d, fd=%d\n", PORT_ECHO, listenechofd);
-    printf("[SERVER]     Time Service port=%d, fd=%d\n\n", PORT_TIME, listentimefd);
+    printf("[SERVER]     Time Service port=%d, fd=%d\n", PORT_TIME, listentimefd);
+    printf("[SERVER]     Handoff path=%s, fd=%d\n\n", HANDOFF_PATH, handofffd);
 
     for ( ; ; ) {
-        // use select() to monitor both listening sockets
+        // use select() to monitor both listening sockets and the control socket,
+        // a next instance waits in its listen queue until the takeover is over
+        FD_ZERO(&rset);
         FD_SET(listenechofd, &rset);
         FD_SET(listentimefd, &rset);
+        if (takeoverfd >= 0)
+            FD_SET(takeoverfd, &rset);
+        else
+            FD_SET(handofffd, &rset);
 
         // need to use select rather than Select provided by Steven
         // cos Steven's Select doesn't handle EINTR
         r = select(maxfdp1, &rset, NULL, NULL, NULL);
 
+        // SIGUSR2 asks for a dump, checked after any wakeup in case another
+        // thread took the signal
+        if (trace_dump_req) {
+            trace_dump_req = 0;
+            trace_dump();
+        }
+
         // slow system call select() may be interrupted
         if (r == -1 && errno == EINTR)
             continue;
+        TRACE(main_wake, -1);
 
-        if (FD_ISSET(listenechofd, &rset)) {
+        if (takeoverfd >= 0 && FD_ISSET(takeoverfd, &rset)) {
+            // live connections from the previous instance
+            if (takeover_recv(takeoverfd) == 0)
+                takeoverfd = -1;
+        }
+        else if (FD_ISSET(handofffd, &rset)) {
+            // a new instance asks for a hot restart
+            if ((ctlfd = accept(handofffd, NULL, NULL)) < 0)
+                continue;
+            if (handoff(ctlfd, listenechofd, listentimefd) == 0)
+                break;
+        }
+        else if (FD_ISSET(listenechofd, &rset)) {
             clilen = sizeof(cliaddr);
-            connfd = Malloc(sizeof(int));
 
             // Echo Service request, accept the connection
             // and create a new thread to handle the request
-            *connfd = Accept(listenechofd, (SA *)&cliaddr, &clilen);
-            Pthread_create(&tid, NULL, &echoserv, connfd);
+            connfd = Accept(listenechofd, (SA *)&cliaddr, &clilen);
+            TRACE(accept, connfd);
+            conn_start(connfd, SERVICE_ECHO);
         }
         else if (FD_ISSET(listentimefd, &rset)) {
             clilen = sizeof(cliaddr);
-            connfd = Malloc(sizeof(int));
 
             // Time Service request, accept the connection
             // and create a new thread to handle the request
-            *connfd = Accept(listentimefd, (SA *)&cliaddr, &clilen);
-            Pthread_create(&tid, NULL, &timeserv, connfd);
+            connfd = Accept(listentimefd, (SA *)&cliaddr, &clilen);
+            TRACE(accept, connfd);
+            conn_start(connfd, SERVICE_TIME);
         }
     }
+
+    // handed over, do not unlink HANDOFF_PATH since it belongs to the new
+    // instance now, then wait for the remaining connections to finish
+    Close(handofffd);
+    Pthread_mutex_lock(&conn_mutex);
+    while (nconns > 0)
+        Pthread_cond_wait(&conn_cond, &conn_mutex);
+    Pthread_mutex_unlock(&conn_mutex);
+
+    printf("\n[SERVER] All connections drained, exit.\n");
     exit(0);
 }
 
@@ -132,7 +1159,7 @@ int main(int argc, char **argv) {
  *
  *  ECHO Service thread function
  *
- *  @param  : void* arg (connected socket file descriptor)
+ *  @param  : void* arg (connection record)
  *  @return : void*
  *  @see    : str_echo
  *
@@ -141,43 +1168,163 @@ int main(int argc, char **argv) {
  * --------------------------------------------------------------------------
  */
 static void *echoserv(void *arg) {
-    // convert the argument to int and free the space
-    int connfd = *((int *)arg);
-    free(arg);
+    struct conn *c = arg;
 
     // detach the thread
     pthread_t tid = pthread_self();
     Pthread_detach(tid);
 
+    // record this thread if the connection is sampled
+    if (c->accepted != 0)
+        trace_attach(c->accepted, c->fd);
+    TRACE(thread_start, c->fd);
+
     printf("\n[SERVER] Echo Service connected (%u).\n", (unsigned int)tid);
-    // call str_echo to handle the ECHO Service
-    str_echo(connfd);
-    Close(connfd);
+    // call str_echo to handle the ECHO Service, until the connection
+    // terminates or is parked for handoff
+    while (str_echo(c->fd) == 1)
+        if (conn_park(c)) {
+            printf("\n[SERVER] Echo Service handed off (%u).\n", (unsigned int)tid);
+            trace_detach();
+            return (NULL);
+        }
+    conn_finish(c);
+    trace_detach();
     printf("\n[SERVER] Echo Service finished.\n");
     return (NULL);
 }
 
+/* --------------------------------------------------------------------------
+ *  echo_lines
+ *
+ *  Line mode ECHO function
+ *
+ *  @param  : int               sockfd
+ *            struct linebuf*   lb
+ *            const char**      data (set to the lines to send back)
+ *            size_t*           len
+ *  @return : ssize_t (as read())
+ *
+ *  Read once into the line buffer and hand out every complete line at
+ *  once, the lines handed out by lb_next are contiguous in the buffer. A
+ *  partial line waits for its newline, or for EOF.
+ * --------------------------------------------------------------------------
+ */
+static ssize_t echo_lines(int sockfd, struct linebuf *lb, const char **data, size_t *len) {
+    ssize_t     n;
+    size_t      m;
+    const char  *line, *first = NULL;
+
+    n = lb_fill(lb);
+    TRACE(read, sockfd);
+
+    // a line longer than the buffer is handed out by lb_next as well
+    *len = 0;
+    if (n == 0)
+        *len = lb_rest(lb, &first);
+    else if (n > 0)
+        while ((m = lb_next(lb, &line)) > 0) {
+            if (first == NULL)
+                first = line;
+            *len += m;
+        }
+    *data = first;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  echo_read
+ *
+ *  ECHO read function
+ *
+ *  @param  : int               sockfd
+ *            struct linebuf*   lb (NULL if not in line mode)
+ *            char*             buf (ECHO_BUFFSIZE bytes, unused in line mode)
+ *            const char**      data (set to the bytes to send back)
+ *            size_t*           len
+ *  @return : ssize_t (as read())
+ *  @see    : echo_lines
+ *
+ *  Read once from a readable socket, shared by str_echo and the event
+ *  loops which send the data back in their own way
+ * --------------------------------------------------------------------------
+ */
+static ssize_t echo_read(int sockfd, struct linebuf *lb, char *buf, const char **data, size_t *len) {
+    ssize_t n;
+
+    if (lb != NULL)
+        return echo_lines(sockfd, lb, data, len);
+
+    // use read rather than Read coz we don't want the server terminates when error occurs
+    n = read(sockfd, buf, ECHO_BUFFSIZE);
+    TRACE(read, sockfd);
+    *data = buf;
+    *len  = (n > 0) ? n : 0;
+    return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  echo_once
+ *
+ *  ECHO step function
+ *
+ *  @param  : int               sockfd
+ *            struct linebuf*   lb (NULL if not in line mode)
+ *  @return : ssize_t (as read())
+ *  @see    : echo_read
+ *
+ *  Read once from a readable socket and send back what has been read
+ * --------------------------------------------------------------------------
+ */
+static ssize_t echo_once(int sockfd, struct linebuf *lb) {
+    ssize_t     n;
+    size_t      len;
+    const char  *data;
+    char        buf[ECHO_BUFFSIZE];
+
+    n = echo_read(sockfd, lb, buf, &data, &len);
+    if (len > 0) {
+        // send back whatever received
+        Writen(sockfd, (void *)data, len);
+        TRACE(write, sockfd);
+    }
+    return n;
+}
+
 /* --------------------------------------------------------------------------
  *  str_echo
  *
  *  ECHO Service function
  *
  *  @param  : int sockfd
- *  @return : void
+ *  @return : int (1 if stopped for handoff, 0 if the client terminated)
  *
  *  Service function to perform standard ECHO Service defined in RFC862
  *  Use select() to monitor the socket status
+ *  In line mode the data goes through a line buffer, see echo_lines
  * --------------------------------------------------------------------------
  */
-void str_echo(int sockfd) {
+int str_echo(int sockfd) {
     ssize_t n;
-    int     r;
+    int     r, parked = 0;
     fd_set  eset;
-    char    buf[ECHO_BUFFSIZE];
+    struct linebuf *lb = NULL;
+
+    if (linemode) {
+        lb = Malloc(sizeof(struct linebuf));
+        lb_init(lb, sockfd);
+    }
 
     FD_ZERO(&eset);
 
     for ( ; ; ) {
+        // nothing but a partial line is buffered between iterations,
+        // safe to stop here when there is none
+        if (handoff_live && (lb == NULL || lb->start == lb->end)) {
+            parked = 1;
+            break;
+        }
+
         FD_SET(sockfd, &eset);
         // need to use select rather than Select provided by Steven
         // cos Steven's Select doesn't handle EINTR
@@ -186,11 +1333,9 @@ void str_echo(int sockfd) {
         // slow system call select() may be interrupted
         if (r < 0 && errno == EINTR)
             continue;
+        TRACE(select_wake, sockfd);
 
-        // use read rather than Read coz we don't want the server terminates when error occurs
-        if ((n = read(sockfd, buf, ECHO_BUFFSIZE)) > 0)
-            // send back whatever received
-            Writen(sockfd, buf, n);
+        n = echo_once(sockfd, lb);
 
         if (n == -1) {
             printf("\n[SERVER] Client termination: socket read returned with value -1\n");
@@ -201,6 +1346,8 @@ void str_echo(int sockfd) {
             break;
         }
     }
+    free(lb);
+    return parked;
 }
 
 /* --------------------------------------------------------------------------
@@ -208,7 +1355,7 @@ void str_echo(int sockfd) {
  *
  *  TIME Service thread function
  *
- *  @param  : void* arg (connected socket file descriptor)
+ *  @param  : void* arg (connection record)
  *  @return : void*
  *  @see    : str_time
  *
@@ -217,18 +1364,28 @@ void str_echo(int sockfd) {
  * --------------------------------------------------------------------------
  */
 static void *timeserv(void *arg) {
-    // convert the argument to int and free the space
-    int connfd = *((int *)arg);
-    free(arg);
+    struct conn *c = arg;
 
     // detach the thread
     pthread_t tid = pthread_self();
     Pthread_detach(tid);
 
+    // record this thread if the connection is sampled
+    if (c->accepted != 0)
+        trace_attach(c->accepted, c->fd);
+    TRACE(thread_start, c->fd);
+
     printf("\n[SERVER] Time Service connected (%u).\n", (unsigned int)tid);
-    // call str_time to handle the TIME Service
-    str_time(connfd);
-    Close(connfd);
+    // call str_time to handle the TIME Service, until the connection
+    // terminates or is parked for handoff
+    while (str_time(c->fd) == 1)
+        if (conn_park(c)) {
+            printf("\n[SERVER] Time Service handed off (%u).\n", (unsigned int)tid);
+            trace_detach();
+            return (NULL);
+        }
+    conn_finish(c);
+    trace_detach();
     printf("\n[SERVER] Time Service finished.\n");
     return (NULL);
 }
@@ -239,14 +1396,14 @@ static void *timeserv(void *arg) {
  *  TIME Service function
  *
  *  @param  : int sockfd
- *  @return : void
+ *  @return : int (1 if stopped for handoff, 0 if the client terminated)
  *
  *  Service function to perform modified DAYTIME Service defined in RFC867,
  *  sending the daytime string to the client every five seconds.
  *  Use select() as an alarm and to monitor the socket status
  * --------------------------------------------------------------------------
  */
-void str_time(int sockfd) {
+int str_time(int sockfd) {
     ssize_t n;
     int     r;
     char    buf[TIME_BUFFSIZE];
@@ -261,6 +1418,10 @@ void str_time(int sockfd) {
     FD_ZERO(&rset);
 
     for ( ; ; ) {
+        // the new instance restarts the five seconds period
+        if (handoff_live)
+            return 1;
+
         FD_SET(sockfd, &rset);
         // need to use select rather than Select provided by Steven
         // cos Steven's Select doesn't handle EINTR
@@ -269,10 +1430,15 @@ void str_time(int sockfd) {
         // slow system call select() may be interrupted
         if (r == -1 && errno == EINTR)
             continue;
+        TRACE(select_wake, sockfd);
 
         // use read rather than Read coz we don't want the server terminates when error occurs
         n = read(sockfd, buf, ECHO_BUFFSIZE);
+        TRACE(read, sockfd);
 
+        // interrupted by SIGUSR1, the loop checks for a handoff
+        if (n == -1 && errno == EINTR)
+            continue;
         if (n == 0) {
             printf("\n[SERVER] Client termination: socket read returned with value 0\n");
             break;
@@ -282,6 +1448,7 @@ void str_time(int sockfd) {
             ticks = time(NULL);
             snprintf(buf, TIME_BUFFSIZE, "%.24s\r\n", ctime(&ticks));
             Write(sockfd, buf, strlen(buf));
+            TRACE(write, sockfd);
             continue;
         }
         if (n == -1) {
@@ -289,4 +1456,5 @@ void str_time(int sockfd) {
             err_ret("str_time: read error"); // do not terminate server
         }
     }
+    return 0;
 }
@@ -12,6 +12,8 @@
 
 int pipefd; // pipe file descriptor passed from client parent
 
+static struct linebuf lb; // receive buffer of the socket
+
 /* --------------------------------------------------------------------------
  *  main
  *
@@ -66,16 +68,24 @@ int main(int argc, char **argv) {
  *  @return : void
  *
  *  Handle all the process between time client child process and the server
+ *  Lines are printed straight from the receive buffer, see linebuf.c
  * --------------------------------------------------------------------------
  */
 void cli_time(int sockfd) {
-    char    recvline[TIME_BUFFSIZE];
+    ssize_t     n;
+
+    lb_init(&lb, sockfd);
 
-    // just use _Readline to get the message from socket
-    while (Readline(sockfd, recvline, TIME_BUFFSIZE) > 0) {
-        // print in both parent and child window
-        Fputs(recvline, stdout);
-        Writen(pipefd, recvline, strlen(recvline)+1);
+    // read the socket and print every line in both parent and child window
+    for ( ; ; ) {
+        if ((n = lb_fill(&lb)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err_sys("cli_time: read error");
+        }
+        lb_flush(&lb, stdout, "", pipefd, n == 0);
+        if (n == 0)
+            break;
     }
     err_quit("cli_time: server terminated prematurely");
 
@@ -0,0 +1,208 @@
+/*
+* @Author: Yinlong Su
+* @Date:   2026-10-19 16:21:08
+* @Last Modified by:   Yinlong Su
+* @Last Modified time: 2026-10-19 16:21:08
+*
+* File:         trace.c
+* Description:  Server stage tracing C file
+*/
+
+#include "echotime.h"
+
+int                         trace_rate = 0;         // sample 1 of trace_rate connections, 0 = off
+__thread struct tracebuf    *trace_tb = NULL;       // buffer of the calling thread, NULL = not sampled
+volatile sig_atomic_t       trace_dump_req = 0;     // set by SIGUSR2
+
+static struct tracebuf      *tracebufs = NULL;
+static int                  ntracebufs = 0;
+static pthread_mutex_t      trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stage_name[TRACE_NSTAGE] = {
+    "main_wake", "accept", "thread_start", "select_wake", "read", "write"
+};
+
+static const char *stage_desc[TRACE_NSTAGE] = {
+    "main select() wait", "accept()", "thread creation", "select() wait", "read()", "Writen()"
+};
+
+/* --------------------------------------------------------------------------
+ *  trace_now
+ *
+ *  Trace clock function
+ *
+ *  @param  : void
+ *  @return : uint64_t (monotonic time in nanoseconds)
+ * --------------------------------------------------------------------------
+ */
+uint64_t trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* --------------------------------------------------------------------------
+ *  trace_attach
+ *
+ *  Start recording the calling thread
+ *
+ *  @param  : uint64_t  accepted (accept timestamp, 0 for none)
+ *            int       fd
+ *  @return : void
+ *
+ *  Take a detached buffer or allocate a new one. The accept timestamp
+ *  taken by the main thread is recorded first, so the thread creation
+ *  span is measured from it.
+ * --------------------------------------------------------------------------
+ */
+void trace_attach(uint64_t accepted, int fd) {
+    struct tracebuf *tb;
+
+    Pthread_mutex_lock(&trace_mutex);
+    for (tb = tracebufs; tb != NULL; tb = tb->link)
+        if (!tb->busy)
+            break;
+    if (tb == NULL) {
+        tb = Malloc(sizeof(struct tracebuf));
+        tb->id   = ntracebufs++;
+        tb->next = 0;
+        tb->link = tracebufs;
+        tracebufs = tb;
+    }
+    tb->busy = 1;
+    Pthread_mutex_unlock(&trace_mutex);
+
+    trace_tb = tb;
+    if (accepted != 0) {
+        tb->ev[tb->next % TRACE_EVENTS].ns    = accepted;
+        tb->ev[tb->next % TRACE_EVENTS].stage = TRACE_accept;
+        tb->ev[tb->next % TRACE_EVENTS].fd    = fd;
+        tb->next++;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  trace_detach
+ *
+ *  Stop recording the calling thread
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  The buffer keeps its events until a later thread wraps around it
+ * --------------------------------------------------------------------------
+ */
+void trace_detach(void) {
+    if (trace_tb == NULL)
+        return;
+
+    Pthread_mutex_lock(&trace_mutex);
+    trace_tb->busy = 0;
+    Pthread_mutex_unlock(&trace_mutex);
+    trace_tb = NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  trace_record
+ *
+ *  Record a stage of the calling thread, called by TRACE only
+ *
+ *  @param  : int stage
+ *            int fd
+ *  @return : void
+ *
+ *  No lock is taken, the buffer belongs to the calling thread. errno is
+ *  kept since str_time checks it after the traced read()
+ * --------------------------------------------------------------------------
+ */
+void trace_record(int stage, int fd) {
+    int                 saved = errno;
+    struct trace_event  *e = &trace_tb->ev[trace_tb->next % TRACE_EVENTS];
+
+    e->ns    = trace_now();
+    e->stage = stage;
+    e->fd    = fd;
+    trace_tb->next++;
+    errno = saved;
+}
+
+/* --------------------------------------------------------------------------
+ *  trace_dump
+ *
+ *  Dump the recorded stages
+ *
+ *  @param  : void
+ *  @return : void
+ *
+ *  Print the latency breakdown, i.e. the time from the previous stage to
+ *  each stage, and write all spans as Chrome trace JSON to TRACE_PATH
+ *  (load it in chrome://tracing or Perfetto). The buffers are read while
+ *  their threads keep recording, spans torn by a wrap around are skipped.
+ * --------------------------------------------------------------------------
+ */
+void trace_dump(void) {
+    struct tracebuf     *tb;
+    struct trace_event  *e, *prev;
+    unsigned long       i, first, last, total = 0;
+    unsigned long       count[TRACE_NSTAGE];
+    uint64_t            sum[TRACE_NSTAGE], maxns[TRACE_NSTAGE], d;
+    int                 s, comma = 0;
+    FILE                *fp;
+
+    bzero(count, sizeof(count));
+    bzero(sum, sizeof(sum));
+    bzero(maxns, sizeof(maxns));
+
+    if ((fp = fopen(TRACE_PATH, "w")) == NULL)
+        err_ret("trace_dump: cannot open %s", TRACE_PATH);
+    else
+        fprintf(fp, "{\"traceEvents\":[\n");
+
+    Pthread_mutex_lock(&trace_mutex);
+    for (tb = tracebufs; tb != NULL; tb = tb->link) {
+        last  = tb->next;
+        first = (last > TRACE_EVENTS) ? last - TRACE_EVENTS + 1 : 1;
+
+        for (i = first; i < last; i++) {
+            prev = &tb->ev[(i - 1) % TRACE_EVENTS];
+            e    = &tb->ev[i % TRACE_EVENTS];
+            s    = e->stage;
+
+            // an accept only follows a main select(), otherwise it starts
+            // a new connection of a reused buffer
+            if (e->ns < prev->ns || s < 0 || s >= TRACE_NSTAGE
+                || (s == TRACE_accept && prev->stage != TRACE_main_wake))
+                continue;
+
+            d = e->ns - prev->ns;
+            count[s]++;
+            sum[s] += d;
+            if (d > maxns[s])
+                maxns[s] = d;
+            total++;
+
+            if (fp != NULL)
+                fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"echotime\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d}}",
+                        comma++ ? ",\n" : "", stage_name[s], prev->ns / 1000.0, d / 1000.0,
+                        (int)getpid(), tb->id, e->fd);
+        }
+    }
+    Pthread_mutex_unlock(&trace_mutex);
+
+    if (fp != NULL) {
+        fprintf(fp, "\n]}\n");
+        fclose(fp);
+    }
+
+    printf("\n[SERVER] Trace: %lu spans in %d threads, written to %s\n", total, ntracebufs, TRACE_PATH);
+    printf("[SERVER]     %-12s %-20s %10s %12s %12s\n", "stage", "span", "count", "avg(us)", "max(us)");
+    for (s = 0; s < TRACE_NSTAGE; s++) {
+        if (count[s] == 0)
+            continue;
+        printf("[SERVER]     %-12s %-20s %10lu %12.1f %12.1f\n", stage_name[s], stage_desc[s],
+               count[s], sum[s] / 1000.0 / count[s], maxns[s] / 1000.0);
+    }
+    fflush(stdout);
+}